@@ -0,0 +1,302 @@
+#ifndef tp_quad_tree_AsyncQueryService_h
+#define tp_quad_tree_AsyncQueryService_h
+
+#include "tp_quad_tree/Globals.h" // IWYU pragma: keep
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+
+namespace tp_quad_tree
+{
+
+//##################################################################################################
+//! Runs nearest queries on a pool of worker threads and returns the results asynchronously
+/*!
+Queries are submitted from any thread and return immediately, the result is delivered through a
+std::future or a callback. Submitted queries are held in a queue and taken by the workers in batches,
+a batch is taken once the queue holds maxBatchSize queries or once the oldest query has waited for
+flushDeadline, whichever comes first. This bounds the time a query spends waiting to be batched
+while still allowing large batches under load.
+
+Each batch is sorted by the Morton order of the query locations before it is run, so consecutive
+queries visit the same cells and find them in cache.
+
+Queries run against a Snapshot of the tree, so the tree can continue to be modified on another
+thread, call setSnapshot() to make later batches use a newer version. Results contain copies of the
+coords so they remain valid after the snapshot has been replaced.
+
+Callbacks are called on a worker thread and should not block.
+
+\tparam Tree - A QuadTreeIntTemplate.
+*/
+template<typename Tree>
+class AsyncQueryService
+{
+public:
+  using Snapshot = typename Tree::Snapshot;
+  using Coord = typename Tree::Coord;
+  using CoordDistance = typename Tree::CoordDistance;
+  using Clock = std::chrono::steady_clock;
+
+  //################################################################################################
+  struct Config
+  {
+    //! The number of worker threads, 0 to use the number of hardware threads.
+    int threads{0};
+
+    //! The maximum number of queries run in a batch, a full batch is run without waiting.
+    size_t maxBatchSize{256};
+
+    //! The longest a query waits in the queue for a batch to fill before it is run.
+    std::chrono::microseconds flushDeadline{200};
+  };
+
+  //################################################################################################
+  struct Result
+  {
+    bool found{false};
+    Coord coord;
+    int distSQ{0};
+  };
+
+  //################################################################################################
+  AsyncQueryService(const Snapshot& snapshot, const Config& config=Config()):
+    m_config(config),
+    m_snapshot(snapshot)
+  {
+    if(m_config.maxBatchSize<1)
+      m_config.maxBatchSize = 1;
+
+    int threads = m_config.threads;
+    if(threads<1)
+      threads = std::max(1, int(std::thread::hardware_concurrency()));
+
+    for(int i=0; i<threads; i++)
+      m_workers.emplace_back([this]{run();});
+  }
+
+  //################################################################################################
+  //! Runs any queries that are still queued then stops the workers
+  ~AsyncQueryService()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_condition.notify_all();
+
+    for(std::thread& worker : m_workers)
+      worker.join();
+  }
+
+  //################################################################################################
+  //! Replace the snapshot used by batches that have not started yet
+  void setSnapshot(const Snapshot& snapshot)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_snapshot = snapshot;
+  }
+
+  //################################################################################################
+  //! Find the closest coord to a point
+  /*!
+  \param x - The x coord of the point to search from.
+  \param y - The y coord of the point to search from.
+  \param callback - Called on a worker thread with the result.
+  \param distSQ - Limits the search radius.
+  */
+  void closestPoint(int x, int y, const std::function<void(const Result&)>& callback, int distSQ=std::numeric_limits<int>::max())
+  {
+    submit(x, y, 1, distSQ, [callback](std::vector<Result>&& results)
+    {
+      callback(results.empty()?Result():results.front());
+    });
+  }
+
+  //################################################################################################
+  std::future<Result> closestPoint(int x, int y, int distSQ=std::numeric_limits<int>::max())
+  {
+    auto promise = std::make_shared<std::promise<Result>>();
+    std::future<Result> future = promise->get_future();
+    closestPoint(x, y, [promise](const Result& result){promise->set_value(result);}, distSQ);
+    return future;
+  }
+
+  //################################################################################################
+  //! Find the k closest coords to a point
+  /*!
+  \param x - The x coord of the point to search from.
+  \param y - The y coord of the point to search from.
+  \param k - The maximum number of coords to return.
+  \param callback - Called on a worker thread with the results sorted by distance.
+  \param distSQ - Limits the search radius.
+  */
+  void kClosestPoints(int x, int y, int k, const std::function<void(std::vector<Result>&&)>& callback, int distSQ=std::numeric_limits<int>::max())
+  {
+    submit(x, y, k, distSQ, callback);
+  }
+
+  //################################################################################################
+  std::future<std::vector<Result>> kClosestPoints(int x, int y, int k, int distSQ=std::numeric_limits<int>::max())
+  {
+    auto promise = std::make_shared<std::promise<std::vector<Result>>>();
+    std::future<std::vector<Result>> future = promise->get_future();
+    submit(x, y, k, distSQ, [promise](std::vector<Result>&& results){promise->set_value(std::move(results));});
+    return future;
+  }
+
+private:
+  AsyncQueryService(const AsyncQueryService&)=delete;
+  AsyncQueryService& operator=(const AsyncQueryService&)=delete;
+
+  //################################################################################################
+  struct Request
+  {
+    int x{0};
+    int y{0};
+    int k{1};
+    int distSQ{0};
+    uint64_t key{0};
+    Clock::time_point submitted;
+    std::function<void(std::vector<Result>&&)> done;
+  };
+
+  //################################################################################################
+  void submit(int x, int y, int k, int distSQ, const std::function<void(std::vector<Result>&&)>& done)
+  {
+    Request request;
+    request.x = x;
+    request.y = y;
+    request.k = k;
+    request.distSQ = distSQ;
+    request.key = mortonKey(x, y);
+    request.submitted = Clock::now();
+    request.done = done;
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_queue.push_back(std::move(request));
+    }
+    m_condition.notify_one();
+  }
+
+  //################################################################################################
+  //! Interleave the bits of x and y, offset so that negative coords sort before positive ones
+  static uint64_t mortonKey(int x, int y)
+  {
+    auto spread = [](uint64_t v)
+    {
+      v = (v | (v<<16)) & 0x0000FFFF0000FFFFull;
+      v = (v | (v<< 8)) & 0x00FF00FF00FF00FFull;
+      v = (v | (v<< 4)) & 0x0F0F0F0F0F0F0F0Full;
+      v = (v | (v<< 2)) & 0x3333333333333333ull;
+      v = (v | (v<< 1)) & 0x5555555555555555ull;
+      return v;
+    };
+
+    return spread(uint32_t(x)^0x80000000u) | (spread(uint32_t(y)^0x80000000u)<<1);
+  }
+
+  //################################################################################################
+  void run()
+  {
+    std::vector<Request> batch;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for(;;)
+    {
+      m_condition.wait(lock, [&]{return m_stop || !m_queue.empty();});
+      if(m_queue.empty())
+        return;
+
+      //Wait for the batch to fill or for the oldest query to reach its deadline. Another worker may
+      //take the front of the queue while this one waits, so the deadline is read again after each
+      //wakeup.
+      while(!m_stop && !m_queue.empty() && m_queue.size()<m_config.maxBatchSize)
+      {
+        Clock::time_point deadline = m_queue.front().submitted + m_config.flushDeadline;
+        if(Clock::now()>=deadline)
+          break;
+        m_condition.wait_until(lock, deadline);
+      }
+
+      if(m_queue.empty())
+        continue;
+
+      size_t n = std::min(m_queue.size(), m_config.maxBatchSize);
+      batch.assign(std::make_move_iterator(m_queue.begin()), std::make_move_iterator(m_queue.begin()+std::ptrdiff_t(n)));
+      m_queue.erase(m_queue.begin(), m_queue.begin()+std::ptrdiff_t(n));
+      Snapshot snapshot = m_snapshot;
+
+      //Let another worker start on what is left.
+      if(!m_queue.empty())
+        m_condition.notify_one();
+
+      lock.unlock();
+      runBatch(snapshot, batch);
+      batch.clear();
+      lock.lock();
+    }
+  }
+
+  //################################################################################################
+  static void runBatch(const Snapshot& snapshot, std::vector<Request>& batch)
+  {
+    std::sort(batch.begin(), batch.end(), [](const Request& a, const Request& b){return a.key<b.key;});
+
+    std::vector<CoordDistance> found;
+    for(Request& request : batch)
+    {
+      std::vector<Result> results;
+      int distSQ = request.distSQ;
+
+      if(request.k==1)
+      {
+        Coord coord = snapshot.closestPoint(request.x, request.y, distSQ);
+        if(distSQ<request.distSQ)
+        {
+          Result& result = results.emplace_back();
+          result.found = true;
+          result.coord = coord;
+          result.distSQ = distSQ;
+        }
+      }
+      else if(request.k>1)
+      {
+        found.clear();
+        snapshot.kClosestPoints(request.x, request.y, request.k, distSQ, found);
+        results.reserve(found.size());
+        for(const CoordDistance& c : found)
+        {
+          Result& result = results.emplace_back();
+          result.found = true;
+          result.coord = *c.coord;
+          result.distSQ = c.distSQ;
+        }
+      }
+
+      request.done(std::move(results));
+    }
+  }
+
+  Config m_config;
+  Snapshot m_snapshot;
+
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::deque<Request> m_queue;
+  bool m_stop{false};
+  std::vector<std::thread> m_workers;
+};
+
+}
+
+#endif
@@ -0,0 +1,385 @@
+#ifndef tp_quad_tree_FrozenQuadTreeIntBuilder_h
+#define tp_quad_tree_FrozenQuadTreeIntBuilder_h
+
+#include "tp_quad_tree/FrozenQuadTreeIntTemplate.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <random>
+#include <atomic>
+#include <utility>
+#include <cstdio>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+namespace tp_quad_tree
+{
+
+//##################################################################################################
+//! Builds a FrozenQuadTreeIntTemplate file from a set of coords that does not fit in memory
+/*!
+The input is read in chunks and partitioned into four bucket files by quadrant, this is repeated for
+each bucket until it is small enough to be built in memory. Each bucket is built into a subtree that
+is appended to temporary files holding the cells, leaf coords, and values, these are then combined
+into a single file in the format written by FrozenQuadTreeIntTemplate::save() that can be memory
+mapped and used with FrozenQuadTreeIntTemplate::view().
+
+The resulting tree has exactly the same shape as a FrozenQuadTreeIntTemplate built in memory from
+the same coords. Memory use is bounded by the budget, except for buckets that cannot be split any
+further because their cells have reached the minimum size, these are always built in memory.
+
+Bucket files and temporary files are created in the temp directory and removed as they are used, at
+peak the temporary files use about twice the size of the input on disk. Their names include a random
+token so several builds can share a temp directory, and they are removed if the build fails.
+*/
+template<typename T>
+class FrozenQuadTreeIntBuilder
+{
+public:
+  using Tree = FrozenQuadTreeIntTemplate<T>;
+  using Coord = typename Tree::Coord;
+
+  //################################################################################################
+  //! Build a frozen tree file from a file of coords
+  /*!
+  \param inputPath - A file containing a raw array of Coord structs, as written from memory.
+  \param outputPath - The tree file to write.
+  \param tempDirectory - Where to write bucket and temporary files.
+  \param minX - The minimum x value
+  \param maxX - The maximum x value
+  \param minY - The minimum y value
+  \param maxY - The maximum y value
+  \param cellSize - The maximum number of coords in a cell
+  \param memoryBudget - The approximate maximum number of bytes to use.
+  \return True on success, false if a file could not be read or written or the size of the input is
+          not a multiple of sizeof(Coord).
+  */
+  static bool build(const std::string& inputPath,
+                    const std::string& outputPath,
+                    const std::string& tempDirectory,
+                    int minX, int maxX, int minY, int maxY,
+                    int cellSize,
+                    size_t memoryBudget)
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "FrozenQuadTreeIntBuilder requires a trivially copyable T");
+
+    FrozenQuadTreeIntBuilder builder(tempDirectory, cellSize, memoryBudget);
+    return builder.run(inputPath, outputPath, minX, maxX, minY, maxY);
+  }
+
+private:
+  using Node = typename Tree::Node;
+  using NodeType = typename Tree::NodeType;
+
+  //################################################################################################
+  //! Removes a temporary file when it goes out of scope
+  class TempFile
+  {
+  public:
+    //##############################################################################################
+    TempFile()=default;
+
+    //##############################################################################################
+    explicit TempFile(const std::string& path):
+      m_path(path)
+    {
+
+    }
+
+    //##############################################################################################
+    TempFile(TempFile&& other) noexcept:
+      m_path(std::move(other.m_path))
+    {
+      other.m_path.clear();
+    }
+
+    //##############################################################################################
+    TempFile& operator=(TempFile&& other) noexcept
+    {
+      remove();
+      m_path = std::move(other.m_path);
+      other.m_path.clear();
+      return *this;
+    }
+
+    //##############################################################################################
+    ~TempFile()
+    {
+      remove();
+    }
+
+    //##############################################################################################
+    const std::string& path() const
+    {
+      return m_path;
+    }
+
+    //##############################################################################################
+    void remove()
+    {
+      if(!m_path.empty())
+        std::remove(m_path.c_str());
+      m_path.clear();
+    }
+
+  private:
+    TempFile(const TempFile&)=delete;
+    TempFile& operator=(const TempFile&)=delete;
+
+    std::string m_path;
+  };
+
+  //################################################################################################
+  FrozenQuadTreeIntBuilder(const std::string& tempDirectory, int cellSize, size_t memoryBudget):
+    m_tempDirectory(tempDirectory),
+    m_token(std::to_string(std::random_device()()) + "_" + std::to_string(std::random_device()())),
+    m_cellSize(cellSize),
+    m_maxInMemory(std::max(size_t(1), memoryBudget/(3*sizeof(Coord)))),
+    m_chunkSize(std::max(size_t(1), memoryBudget/(2*sizeof(Coord))))
+  {
+
+  }
+
+  //################################################################################################
+  bool run(const std::string& inputPath, const std::string& outputPath, int minX, int maxX, int minY, int maxY)
+  {
+    TempFile nodes(tempPath("nodes"));
+    TempFile data(tempPath("data"));
+    TempFile values(tempPath("values"));
+
+    m_nodes.open(nodes.path(), std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+    m_data.open(data.path(), std::ios::binary | std::ios::trunc);
+    m_values.open(values.path(), std::ios::binary | std::ios::trunc);
+    if(!m_nodes || !m_data || !m_values)
+      return false;
+
+    uint64_t count=0;
+    {
+      std::ifstream in(inputPath, std::ios::binary | std::ios::ate);
+      if(!in)
+        return false;
+
+      uint64_t size = uint64_t(in.tellg());
+      if((size%sizeof(Coord))!=0)
+        return false;
+      count = size/sizeof(Coord);
+    }
+
+    int radX = (maxX-minX)/2;
+    int radY = (maxY-minY)/2;
+    m_nodeCount = 1;
+    if(!process(inputPath, TempFile(), count, 0, minX+radX, minY+radY, radX, radY))
+      return false;
+
+    m_nodes.close();
+    m_data.close();
+    m_values.close();
+    return assemble(outputPath, nodes.path(), data.path(), values.path());
+  }
+
+  //################################################################################################
+  //! Build the cell at nodeIndex from the coords in a bucket file
+  /*!
+  \param path - The file to read the coords from.
+  \param bucket - Owns path if it is a bucket file, this removes it once it has been read.
+  */
+  bool process(const std::string& path, TempFile bucket, uint64_t count, uint64_t nodeIndex, int cx, int cy, int radX, int radY)
+  {
+    int nRadX = radX/2;
+    int nRadY = radY/2;
+
+    if(count<=m_maxInMemory || count<=uint64_t(m_cellSize) || nRadX<=1 || nRadY<=1)
+      return buildInMemory(path, std::move(bucket), count, nodeIndex, cx, cy, radX, radY);
+
+    uint64_t first = m_nodeCount;
+    m_nodeCount+=4;
+    if(m_nodeCount>std::numeric_limits<uint32_t>::max())
+      return false;
+
+    Node node{};
+    node.type = NodeType::Internal;
+    node.cx = cx;
+    node.cy = cy;
+    node.first = uint32_t(first);
+    if(!writeNode(nodeIndex, node))
+      return false;
+
+    //0=x0 y0
+    //1=x1 y0
+    //2=x0 y1
+    //3=x1 y1
+    TempFile childBuckets[4];
+    uint64_t childCounts[4] = {0, 0, 0, 0};
+    {
+      std::ofstream children[4];
+      for(int i=0; i<4; i++)
+      {
+        childBuckets[i] = TempFile(tempPath("bucket"));
+        children[i].open(childBuckets[i].path(), std::ios::binary | std::ios::trunc);
+        if(!children[i])
+          return false;
+      }
+
+      std::ifstream in(path, std::ios::binary);
+      std::vector<Coord> chunk(size_t(std::min(count, uint64_t(m_chunkSize))));
+      for(uint64_t done=0; done<count;)
+      {
+        size_t n = size_t(std::min(count-done, uint64_t(chunk.size())));
+        if(!in.read(reinterpret_cast<char*>(chunk.data()), std::streamsize(n*sizeof(Coord))))
+          return false;
+        done+=n;
+
+        for(size_t i=0; i<n; i++)
+        {
+          const Coord& c = chunk[i];
+          int q = (c.x<cx)?((c.y<cy)?0:2):((c.y<cy)?1:3);
+          children[q].write(reinterpret_cast<const char*>(&c), sizeof(Coord));
+          childCounts[q]++;
+        }
+      }
+
+      for(int i=0; i<4; i++)
+        if(!children[i].flush())
+          return false;
+    }
+
+    bucket.remove();
+
+    //Take copies of the paths, each bucket is moved into the call that consumes it.
+    std::string childPaths[4];
+    for(int i=0; i<4; i++)
+      childPaths[i] = childBuckets[i].path();
+
+    return process(childPaths[0], std::move(childBuckets[0]), childCounts[0], first+0, cx-nRadX, cy-nRadY, nRadX, nRadY) &&
+           process(childPaths[1], std::move(childBuckets[1]), childCounts[1], first+1, cx+nRadX, cy-nRadY, nRadX, nRadY) &&
+           process(childPaths[2], std::move(childBuckets[2]), childCounts[2], first+2, cx-nRadX, cy+nRadY, nRadX, nRadY) &&
+           process(childPaths[3], std::move(childBuckets[3]), childCounts[3], first+3, cx+nRadX, cy+nRadY, nRadX, nRadY);
+  }
+
+  //################################################################################################
+  //! Build a bucket into a subtree in memory and append it to the temporary files
+  bool buildInMemory(const std::string& path, TempFile bucket, uint64_t count, uint64_t nodeIndex, int cx, int cy, int radX, int radY)
+  {
+    std::vector<Coord> coords;
+    coords.resize(size_t(count));
+    {
+      std::ifstream in(path, std::ios::binary);
+      if(count && !in.read(reinterpret_cast<char*>(coords.data()), std::streamsize(count*sizeof(Coord))))
+        return false;
+    }
+
+    bucket.remove();
+
+    Tree tree;
+    tree.m_cellSize = m_cellSize;
+    tree.buildRoot(cx, cy, radX, radY, std::move(coords));
+
+    //Local node 0 goes in the slot allocated by the parent, the rest are appended. Leaf data is
+    //appended on a 4 byte boundary so leaf offsets can be moved by whole units.
+    uint64_t nodeBase = m_nodeCount-1;
+    uint64_t dataBase = (m_dataSize+3)&~uint64_t(3);
+    uint64_t valueBase = m_valueCount;
+
+    m_nodeCount += tree.m_nodeCount-1;
+    if(m_nodeCount>std::numeric_limits<uint32_t>::max() ||
+       (valueBase+tree.m_valueCount)>std::numeric_limits<uint32_t>::max() ||
+       ((dataBase+tree.m_dataSize)/4)>std::numeric_limits<uint32_t>::max())
+      return false;
+
+    for(size_t i=0; i<tree.m_nodeCount; i++)
+    {
+      Node node = tree.m_nodePtr[i];
+      if(node.type == NodeType::Internal)
+        node.first = uint32_t(nodeBase + node.first);
+      else
+      {
+        node.first = uint32_t(valueBase + node.first);
+        node.offset = uint32_t(dataBase/4 + node.offset);
+      }
+
+      if(!writeNode((i==0)?nodeIndex:(nodeBase+i), node))
+        return false;
+    }
+
+    for(; m_dataSize<dataBase; m_dataSize++)
+      m_data.put(0);
+    m_data.write(reinterpret_cast<const char*>(tree.m_dataPtr), std::streamsize(tree.m_dataSize));
+    m_dataSize += tree.m_dataSize;
+
+    m_values.write(reinterpret_cast<const char*>(tree.m_valuePtr), std::streamsize(tree.m_valueCount*sizeof(T)));
+    m_valueCount += tree.m_valueCount;
+
+    return m_data.good() && m_values.good();
+  }
+
+  //################################################################################################
+  bool writeNode(uint64_t index, const Node& node)
+  {
+    m_nodes.seekp(std::streamoff(index*sizeof(Node)));
+    m_nodes.write(reinterpret_cast<const char*>(&node), sizeof(Node));
+    return m_nodes.good();
+  }
+
+  //################################################################################################
+  //! Write the header and copy the temporary files into the output file
+  bool assemble(const std::string& outputPath, const std::string& nodesPath, const std::string& dataPath, const std::string& valuesPath)
+  {
+    typename Tree::FileHeader header = Tree::makeHeader(m_cellSize, m_nodeCount, m_dataSize, m_valueCount);
+    typename Tree::Sections sections(header);
+
+    std::ofstream out(outputPath, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    Tree::pad(out, sizeof(header), sections.nodes);
+    if(!append(out, nodesPath, m_nodeCount*sizeof(Node)))
+      return false;
+    Tree::pad(out, sections.nodes+m_nodeCount*sizeof(Node), sections.data);
+    if(!append(out, dataPath, m_dataSize))
+      return false;
+    Tree::pad(out, sections.data+m_dataSize, sections.values);
+    if(!append(out, valuesPath, m_valueCount*sizeof(T)))
+      return false;
+    return out.good();
+  }
+
+  //################################################################################################
+  bool append(std::ofstream& out, const std::string& path, uint64_t size)
+  {
+    std::ifstream in(path, std::ios::binary);
+    std::vector<char> buffer(size_t(std::min(size, uint64_t(std::max(size_t(4096), m_chunkSize*sizeof(Coord))))));
+    for(uint64_t done=0; done<size;)
+    {
+      size_t n = size_t(std::min(size-done, uint64_t(buffer.size())));
+      if(!in.read(buffer.data(), std::streamsize(n)))
+        return false;
+      out.write(buffer.data(), std::streamsize(n));
+      done+=n;
+    }
+    return out.good();
+  }
+
+  //################################################################################################
+  std::string tempPath(const char* name)
+  {
+    static std::atomic<uint64_t> nextTempFile{0};
+    return m_tempDirectory + "/tp_quad_tree_" + name + "_" + m_token + "_" + std::to_string(nextTempFile++) + ".bin";
+  }
+
+  std::string m_tempDirectory;
+  std::string m_token; //!< Random, so that builds sharing a temp directory use different names.
+  int m_cellSize;
+  size_t m_maxInMemory;
+  size_t m_chunkSize;
+
+  std::fstream m_nodes;
+  std::ofstream m_data;
+  std::ofstream m_values;
+  uint64_t m_nodeCount{0};
+  uint64_t m_dataSize{0};
+  uint64_t m_valueCount{0};
+};
+
+}
+
+#endif
@@ -0,0 +1,532 @@
+#ifndef tp_quad_tree_FrozenQuadTreeIntTemplate_h
+#define tp_quad_tree_FrozenQuadTreeIntTemplate_h
+
+#include "tp_quad_tree/QuadTreeIntTemplate.h"
+#include "tp_quad_tree/Trace.h"
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <ostream>
+#include <type_traits>
+
+namespace tp_quad_tree
+{
+
+template<typename T>
+class FrozenQuadTreeIntBuilder;
+
+//##################################################################################################
+//! A read only quad tree with compressed leaf storage
+/*!
+This has the same cell structure as QuadTreeIntTemplate but is built once from a complete set of
+coords and then frozen. Cells are stored in a flat array and the coords of each leaf are stored
+relative to the bottom left corner of the leaf's points, using 8 or 16 bit deltas where the extent
+of the leaf permits it. Leaf coords are stored as separate x and y arrays so that the distance loop
+in closestPoint() can be vectorized by the compiler.
+
+Values are stored in a separate array in leaf order.
+
+The tree can be saved to a flat file with save() and then used in place from a memory mapped copy of
+that file with view(), see also FrozenQuadTreeIntBuilder for building trees larger than memory.
+*/
+template<typename T>
+class FrozenQuadTreeIntTemplate
+{
+  friend class FrozenQuadTreeIntBuilder<T>;
+public:
+  using Coord = typename QuadTreeIntTemplate<T>::Coord;
+
+  //################################################################################################
+  //! Build a frozen tree from a set of coords
+  /*!
+  The bounds and cellSize have the same meaning as they do for QuadTreeIntTemplate, the resulting
+  tree has the same shape as a QuadTreeIntTemplate that the coords had been added to.
+
+  \param minX - The minimum x value
+  \param maxX - The maximum x value
+  \param minY - The minimum y value
+  \param maxY - The maximum y value
+  \param cellSize - The maximum number of coords in a cell
+  \param coords - The coords to add to the tree, these are reordered and consumed.
+  */
+  FrozenQuadTreeIntTemplate(int minX, int maxX, int minY, int maxY, int cellSize, std::vector<Coord>&& coords):
+    m_cellSize(cellSize)
+  {
+    int radX = (maxX-minX)/2;
+    int radY = (maxY-minY)/2;
+    buildRoot(minX+radX, minY+radY, radX, radY, std::move(coords));
+  }
+
+  //################################################################################################
+  //! Write the tree to a stream in the format used by view()
+  /*!
+  The file is a header followed by the cells, the leaf coords, and the values, each section aligned
+  to 16 bytes. The values are written as raw bytes so T must be trivially copyable.
+
+  \param os - The stream to write to, this should be opened in binary mode.
+  \return True if the stream is good after writing.
+  */
+  bool save(std::ostream& os) const
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "save() requires a trivially copyable T");
+
+    FileHeader header = makeHeader(m_cellSize, m_nodeCount, m_dataSize, m_valueCount);
+    Sections sections(header);
+
+    os.write(reinterpret_cast<const char*>(&header), sizeof(FileHeader));
+    pad(os, sizeof(FileHeader), sections.nodes);
+    os.write(reinterpret_cast<const char*>(m_nodePtr), std::streamsize(m_nodeCount*sizeof(Node)));
+    pad(os, sections.nodes+m_nodeCount*sizeof(Node), sections.data);
+    os.write(reinterpret_cast<const char*>(m_dataPtr), std::streamsize(m_dataSize));
+    pad(os, sections.data+m_dataSize, sections.values);
+    os.write(reinterpret_cast<const char*>(m_valuePtr), std::streamsize(m_valueCount*sizeof(T)));
+    return os.good();
+  }
+
+  //################################################################################################
+  //! Use a tree that has been saved with save() in place
+  /*!
+  This does not copy the buffer, it is intended to be used with a memory mapped file. The buffer
+  must remain valid and unchanged for the lifetime of the returned tree and must be aligned to at
+  least 16 bytes.
+
+  The sections and every cell are checked against the size of the buffer, so a truncated or
+  corrupted file is rejected rather than read out of bounds. The coords and values themselves are
+  not checked.
+
+  \param buffer - The contents of a file written by save() or FrozenQuadTreeIntBuilder.
+  \param size - The size of the buffer in bytes.
+  \return The tree or nullptr if the buffer is not a valid tree for this T.
+  */
+  static std::unique_ptr<FrozenQuadTreeIntTemplate> view(const void* buffer, size_t size)
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "view() requires a trivially copyable T");
+
+    if(!buffer || size<sizeof(FileHeader) || (reinterpret_cast<uintptr_t>(buffer)%16)!=0)
+      return nullptr;
+
+    FileHeader header;
+    std::memcpy(&header, buffer, sizeof(FileHeader));
+    FileHeader expected = makeHeader(header.cellSize, header.nodeCount, header.dataSize, header.valueCount);
+    if(std::memcmp(&header, &expected, sizeof(FileHeader))!=0 || header.nodeCount==0)
+      return nullptr;
+
+    if(!sectionsFit(header, size))
+      return nullptr;
+
+    Sections sections(header);
+    const uint8_t* bytes = static_cast<const uint8_t*>(buffer);
+    std::unique_ptr<FrozenQuadTreeIntTemplate> tree(new FrozenQuadTreeIntTemplate());
+    tree->m_cellSize = header.cellSize;
+    tree->m_nodePtr = reinterpret_cast<const Node*>(bytes+sections.nodes);
+    tree->m_nodeCount = size_t(header.nodeCount);
+    tree->m_dataPtr = bytes+sections.data;
+    tree->m_dataSize = size_t(header.dataSize);
+    tree->m_valuePtr = reinterpret_cast<const T*>(bytes+sections.values);
+    tree->m_valueCount = size_t(header.valueCount);
+    if(!tree->validNodes())
+      return nullptr;
+
+    return tree;
+  }
+
+  //################################################################################################
+  //! Find the closest coord to the point
+  /*!
+  \param x - The x coord of the point to search from.
+  \param y - The y coord of the point to search from.
+  \param distSQ - This will be updated with the distance to the closest coord the initial value \
+         will limit the search radius.
+  \return The coord if one is found, else a null Coord.
+  */
+  Coord closestPoint(int x, int y, int& distSQ) const
+  {
+    TP_QUAD_TREE_TRACE_SCOPE(Query);
+    const Node* leaf=nullptr;
+    uint32_t index=0;
+    closestPoint(m_nodePtr, x, y, distSQ, leaf, index);
+
+    if(!leaf)
+      return Coord();
+
+    return Coord(leaf->cx + decode(*leaf, index, 0),
+                 leaf->cy + decode(*leaf, index, 1),
+                 m_valuePtr[leaf->first+index]);
+  }
+
+  //################################################################################################
+  int size() const
+  {
+    return int(m_valueCount);
+  }
+
+  //################################################################################################
+  //! Returns the number of bytes used by the cells, the coords, and the values
+  size_t memoryUsage() const
+  {
+    return m_nodeCount*sizeof(Node) + m_dataSize + m_valueCount*sizeof(T);
+  }
+
+private:
+  FrozenQuadTreeIntTemplate(const FrozenQuadTreeIntTemplate&)=delete;
+  FrozenQuadTreeIntTemplate& operator=(const FrozenQuadTreeIntTemplate&)=delete;
+
+  //################################################################################################
+  FrozenQuadTreeIntTemplate()=default;
+
+  //################################################################################################
+  //! Build from the centre and radius of the root cell
+  void buildRoot(int cx, int cy, int radX, int radY, std::vector<Coord>&& coords)
+  {
+    m_nodes.emplace_back();
+    build(coords.data(), 0, coords.data(), coords.data()+coords.size(), cx, cy, radX, radY);
+
+    m_values.reserve(coords.size());
+    for(const Coord& coord : coords)
+      m_values.push_back(coord.value);
+
+    m_nodes.shrink_to_fit();
+    m_data.shrink_to_fit();
+
+    m_nodePtr = m_nodes.data();
+    m_nodeCount = m_nodes.size();
+    m_dataPtr = m_data.data();
+    m_dataSize = m_data.size();
+    m_valuePtr = m_values.data();
+    m_valueCount = m_values.size();
+  }
+
+  //################################################################################################
+  struct FileHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t nodeSize;
+    uint32_t valueSize;
+    int32_t cellSize;
+    uint64_t nodeCount;
+    uint64_t dataSize;
+    uint64_t valueCount;
+  };
+
+  //################################################################################################
+  static FileHeader makeHeader(int cellSize, uint64_t nodeCount, uint64_t dataSize, uint64_t valueCount)
+  {
+    FileHeader header;
+    std::memset(&header, 0, sizeof(FileHeader));
+    std::memcpy(header.magic, "tpqtfrz", 8);
+    header.version = 1;
+    header.nodeSize = uint32_t(sizeof(Node));
+    header.valueSize = uint32_t(sizeof(T));
+    header.cellSize = cellSize;
+    header.nodeCount = nodeCount;
+    header.dataSize = dataSize;
+    header.valueCount = valueCount;
+    return header;
+  }
+
+  //################################################################################################
+  //! The byte offsets of each section of a saved tree
+  struct Sections
+  {
+    size_t nodes;
+    size_t data;
+    size_t values;
+    size_t end;
+
+    Sections(const FileHeader& header):
+      nodes(align(sizeof(FileHeader))),
+      data(align(nodes+size_t(header.nodeCount)*sizeof(Node))),
+      values(align(data+size_t(header.dataSize))),
+      end(values+size_t(header.valueCount)*sizeof(T))
+    {
+
+    }
+
+    static size_t align(size_t offset)
+    {
+      return (offset+15)&~size_t(15);
+    }
+  };
+
+  //################################################################################################
+  //! Returns true if the sections described by the header fit in size bytes, without overflowing
+  static bool sectionsFit(const FileHeader& header, size_t size)
+  {
+    size_t offset = sizeof(FileHeader);
+    auto section = [&](uint64_t count, size_t itemSize)
+    {
+      size_t start = Sections::align(offset);
+      if(start<offset || start>size || count>(size-start)/itemSize)
+        return false;
+
+      offset = start + size_t(count)*itemSize;
+      return true;
+    };
+
+    return section(header.nodeCount, sizeof(Node)) &&
+           section(header.dataSize, 1) &&
+           section(header.valueCount, sizeof(T));
+  }
+
+  //################################################################################################
+  static void pad(std::ostream& os, size_t from, size_t to)
+  {
+    for(; from<to; from++)
+      os.put(0);
+  }
+
+  //################################################################################################
+  enum class NodeType : uint8_t
+  {
+    Internal,
+    Leaf8,
+    Leaf16,
+    Leaf32
+  };
+
+  //################################################################################################
+  //! For internal nodes cx and cy are the split point and first is the index of the first of four
+  //! consecutive children. For leaves cx and cy are the origin of the deltas, first is the index
+  //! of the first value, and offset is the offset of the x deltas followed by the y deltas in
+  //! units of 4 bytes.
+  //!
+  //! Nodes are written to disk as raw bytes, the padding is explicit so that every byte is
+  //! initialized and the same tree always produces the same file.
+  struct Node
+  {
+    int cx{0};
+    int cy{0};
+    uint32_t first{0};
+    uint32_t offset{0};
+    uint32_t count{0};
+    NodeType type{NodeType::Leaf8};
+    uint8_t padding[3]{0, 0, 0};
+  };
+  static_assert(sizeof(Node)==24, "Node must not contain implicit padding");
+
+  //################################################################################################
+  //! The deepest tree that view() will accept, this bounds the recursion in closestPoint()
+  static constexpr uint8_t maxDepth = 64;
+
+  //################################################################################################
+  //! Returns true if every cell refers to children, coords, and values inside the arrays
+  /*!
+  Both build() and FrozenQuadTreeIntBuilder place children after their parent, requiring this rules
+  out cycles and lets the depth of each cell be found in a single pass.
+  */
+  bool validNodes() const
+  {
+    std::vector<uint8_t> depth(m_nodeCount, 0);
+    for(size_t i=0; i<m_nodeCount; i++)
+    {
+      const Node& node = m_nodePtr[i];
+      switch(node.type)
+      {
+      case NodeType::Internal:
+        if(node.first<=i || (uint64_t(node.first)+4)>m_nodeCount || depth[i]>=maxDepth)
+          return false;
+        for(size_t c=node.first; c<size_t(node.first)+4; c++)
+          depth[c] = std::max(depth[c], uint8_t(depth[i]+1));
+        break;
+
+      case NodeType::Leaf8:  if(!validLeaf(node, sizeof(uint8_t ))) return false; break;
+      case NodeType::Leaf16: if(!validLeaf(node, sizeof(uint16_t))) return false; break;
+      case NodeType::Leaf32: if(!validLeaf(node, sizeof(uint32_t))) return false; break;
+      default: return false;
+      }
+    }
+    return true;
+  }
+
+  //################################################################################################
+  bool validLeaf(const Node& node, size_t deltaSize) const
+  {
+    return (uint64_t(node.first)+node.count)<=m_valueCount &&
+           (uint64_t(node.offset)*4 + 2*uint64_t(deltaSize)*node.count)<=m_dataSize;
+  }
+
+  //################################################################################################
+  void build(const Coord* base, size_t nodeIndex, Coord* begin, Coord* end, int cx, int cy, int radX, int radY)
+  {
+    int nRadX = radX/2;
+    int nRadY = radY/2;
+
+    if((end-begin)>m_cellSize && nRadX>1 && nRadY>1)
+    {
+      //0=x0 y0
+      //1=x1 y0
+      //2=x0 y1
+      //3=x1 y1
+      Coord* y1 = std::partition(begin, end, [&](const Coord& c){return c.y<cy;});
+      Coord* x1y0 = std::partition(begin, y1, [&](const Coord& c){return c.x<cx;});
+      Coord* x1y1 = std::partition(y1, end, [&](const Coord& c){return c.x<cx;});
+
+      uint32_t first = uint32_t(m_nodes.size());
+      m_nodes.resize(m_nodes.size()+4);
+
+      Node& node = m_nodes[nodeIndex];
+      node.type = NodeType::Internal;
+      node.cx = cx;
+      node.cy = cy;
+      node.first = first;
+
+      build(base, first+0, begin, x1y0, cx-nRadX, cy-nRadY, nRadX, nRadY);
+      build(base, first+1, x1y0,  y1,   cx+nRadX, cy-nRadY, nRadX, nRadY);
+      build(base, first+2, y1,    x1y1, cx-nRadX, cy+nRadY, nRadX, nRadY);
+      build(base, first+3, x1y1,  end,  cx+nRadX, cy+nRadY, nRadX, nRadY);
+      return;
+    }
+
+    Node& node = m_nodes[nodeIndex];
+    node.first = uint32_t(begin-base);
+    node.count = uint32_t(end-begin);
+
+    if(begin==end)
+      return;
+
+    int ox=begin->x;
+    int oy=begin->y;
+    int64_t mx=begin->x;
+    int64_t my=begin->y;
+    for(const Coord* c=begin; c<end; c++)
+    {
+      ox = std::min(ox, c->x);
+      oy = std::min(oy, c->y);
+      mx = std::max(mx, int64_t(c->x));
+      my = std::max(my, int64_t(c->y));
+    }
+    node.cx = ox;
+    node.cy = oy;
+
+    int64_t extent = std::max(mx-ox, my-oy);
+    if(extent<=0xFF)
+      encode<uint8_t>(node, NodeType::Leaf8, begin, end);
+    else if(extent<=0xFFFF)
+      encode<uint16_t>(node, NodeType::Leaf16, begin, end);
+    else
+      encode<uint32_t>(node, NodeType::Leaf32, begin, end);
+  }
+
+  //################################################################################################
+  template<typename D>
+  void encode(Node& node, NodeType type, const Coord* begin, const Coord* end)
+  {
+    size_t offset = (m_data.size()+3)&~size_t(3);
+    m_data.resize(offset + 2*sizeof(D)*size_t(end-begin));
+
+    node.type = type;
+    node.offset = uint32_t(offset/4);
+
+    D* xs = reinterpret_cast<D*>(m_data.data()+offset);
+    D* ys = xs + (end-begin);
+    for(const Coord* c=begin; c<end; c++, xs++, ys++)
+    {
+      *xs = D(uint32_t(c->x-node.cx));
+      *ys = D(uint32_t(c->y-node.cy));
+    }
+  }
+
+  //################################################################################################
+  int decode(const Node& node, uint32_t index, uint32_t axis) const
+  {
+    const uint8_t* data = m_dataPtr + size_t(node.offset)*4;
+    size_t i = size_t(axis)*node.count + index;
+    switch(node.type)
+    {
+    case NodeType::Leaf8:  return int(reinterpret_cast<const uint8_t* >(data)[i]);
+    case NodeType::Leaf16: return int(reinterpret_cast<const uint16_t*>(data)[i]);
+    case NodeType::Leaf32: return int(reinterpret_cast<const uint32_t*>(data)[i]);
+    default: return 0;
+    }
+  }
+
+  //################################################################################################
+  void closestPoint(const Node* node, int x, int y, int& distSQ, const Node*& leaf, uint32_t& index) const
+  {
+    if(node->type == NodeType::Internal)
+    {
+      int dx = node->cx-x;
+      dx*=dx;
+      int dy = node->cy-y;
+      dy*=dy;
+
+      int q = ((x<node->cx)?0:1) | ((y<node->cy)?0:2);
+      const Node* children = m_nodePtr + node->first;
+      detail::visitClosestChildFirst(q, dx, dy, distSQ, [&](int child)
+      {
+        closestPoint(children+child, x, y, distSQ, leaf, index);
+      });
+      return;
+    }
+
+    TP_QUAD_TREE_TRACE_SCOPE(LeafScan);
+    const uint8_t* data = m_dataPtr + size_t(node->offset)*4;
+    switch(node->type)
+    {
+    case NodeType::Leaf8:  scanLeaf(reinterpret_cast<const uint8_t* >(data), node, x, y, distSQ, leaf, index); break;
+    case NodeType::Leaf16: scanLeaf(reinterpret_cast<const uint16_t*>(data), node, x, y, distSQ, leaf, index); break;
+    case NodeType::Leaf32: scanLeaf(reinterpret_cast<const uint32_t*>(data), node, x, y, distSQ, leaf, index); break;
+    default: break;
+    }
+  }
+
+  //################################################################################################
+  //! Distances are calculated a block at a time into a local buffer, this first loop has no
+  //! branches and is vectorized, the second loop finds the minimum.
+  template<typename D>
+  static void scanLeaf(const D* xs, const Node* node, int x, int y, int& distSQ, const Node*& leaf, uint32_t& index)
+  {
+    constexpr uint32_t blockSize=64;
+    int dist[blockSize];
+
+    uint32_t count = node->count;
+    const D* ys = xs + count;
+    int qx = x-node->cx;
+    int qy = y-node->cy;
+
+    for(uint32_t b=0; b<count; b+=blockSize)
+    {
+      uint32_t n = std::min(blockSize, count-b);
+
+      for(uint32_t i=0; i<n; i++)
+      {
+        int dx = int(xs[b+i])-qx;
+        int dy = int(ys[b+i])-qy;
+        dist[i] = (dx*dx) + (dy*dy);
+      }
+
+      for(uint32_t i=0; i<n; i++)
+      {
+        if(dist[i]<distSQ)
+        {
+          distSQ = dist[i];
+          leaf = node;
+          index = b+i;
+        }
+      }
+    }
+  }
+
+  int m_cellSize{0};
+
+  //Storage used when the tree is built in memory.
+  std::vector<Node> m_nodes;
+  std::vector<uint8_t> m_data;
+  std::vector<T> m_values;
+
+  //The arrays used by queries, these point either at the vectors above or into a viewed buffer.
+  const Node* m_nodePtr{nullptr};
+  size_t m_nodeCount{0};
+  const uint8_t* m_dataPtr{nullptr};
+  size_t m_dataSize{0};
+  const T* m_valuePtr{nullptr};
+  size_t m_valueCount{0};
+};
+
+}
+
+#endif
@@ -0,0 +1,324 @@
+#ifndef tp_quad_tree_QuadTreeExactTemplate_h
+#define tp_quad_tree_QuadTreeExactTemplate_h
+
+#include "tp_quad_tree/Globals.h" // IWYU pragma: keep
+#include "tp_quad_tree/QuadTreePolicies.h"
+
+#include "tp_utils/Globals.h"
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <type_traits>
+
+namespace tp_quad_tree
+{
+
+//##################################################################################################
+//! A quad tree for double or int64 coords with exact split arithmetic at every depth
+/*!
+QuadTreeFloat describes each cell by a centre and a radius and halves the radius at each split, at
+depth the rounding errors accumulate and the centres of neighbouring cells collapse onto each other.
+This tree stores the bounds of each cell instead, a child's bounds are exactly its parent's bounds
+and split point, so the cells always tile the parent with no gaps or overlaps regardless of depth.
+The split point is only rounded once from the parent's bounds, and a cell is only split if its
+split point lies strictly inside it, so splitting stops cleanly once the resolution of the type has
+been exhausted rather than producing degenerate cells.
+
+Squared distances are returned as doubles. For int64 coords the differences are calculated in
+unsigned integer arithmetic before being converted, so they can not overflow anywhere in the int64
+range and are exact while they are below 2^53. The square of any int64 difference fits in a double.
+
+To compare against QuadTreeFloat on the same data, replay the same query log against both with
+QueryProfiler::replay(), for example:
+\code
+tp_quad_tree::LatencyReport exact = tp_quad_tree::QueryProfiler::replay(queries, [&](const tp_quad_tree::QueryRecord& q)
+{
+  double distSQ = std::numeric_limits<double>::max();
+  exactTree.closestPoint(q.x, q.y, distSQ);
+});
+
+tp_quad_tree::LatencyReport single = tp_quad_tree::QueryProfiler::replay(queries, [&](const tp_quad_tree::QueryRecord& q)
+{
+  float distSQ = std::numeric_limits<float>::max();
+  floatTree.closestPoint(tp_quad_tree::QuadTreeFloat::Coord(float(q.x), float(q.y)), distSQ);
+});
+\endcode
+
+\tparam Scalar - The coord type, double or int64_t.
+\tparam T - The type of value stored with each coord.
+*/
+template<typename Scalar, typename T>
+class QuadTreeExactTemplate
+{
+public:
+
+  //################################################################################################
+  struct Coord
+  {
+    Scalar x;
+    Scalar y;
+
+    T value;
+
+    //##############################################################################################
+    Coord(Scalar x_=0, Scalar y_=0, const T& value_=T()):
+      x(x_),
+      y(y_),
+      value(value_)
+    {
+
+    }
+  };
+
+  //################################################################################################
+  struct CoordDistance
+  {
+    const Coord* coord;
+    double distSQ;
+
+    CoordDistance(const Coord* coord_=nullptr, double distSQ_=0.0):
+      coord(coord_),
+      distSQ(distSQ_)
+    {
+
+    }
+  };
+
+  //################################################################################################
+  //! Construct an empty quad tree
+  /*!
+  \param minX - The minimum x value
+  \param maxX - The maximum x value
+  \param minY - The minimum y value
+  \param maxY - The maximum y value
+  \param cellSize - The maximum number of coords in a cell
+  */
+  QuadTreeExactTemplate(Scalar minX, Scalar maxX, Scalar minY, Scalar maxY, int cellSize):
+    m_root(new Cell(minX, maxX, minY, maxY, cellSize))
+  {
+
+  }
+
+  //################################################################################################
+  //! Add a coordinate to the tree
+  /*!
+  This will add a coordinate to the tree, this will divide cells as required.
+
+  \param coord - The coordinate to add.
+  */
+  void addCoord(const Coord& coord)
+  {
+    m_root->addCoord(coord);
+    m_count++;
+  }
+
+  //################################################################################################
+  //! Find the closes coord to the point
+  /*!
+  \param x - The x coord of the point to search from.
+  \param y - The y coord of the point to search from.
+  \param distSQ - This will be updated with the distance to the closest coord the initial value \
+         will limit the search radius.
+  \return The coord if one is found, else a null Coord.
+  */
+  Coord closestPoint(Scalar x, Scalar y, double& distSQ) const
+  {
+    const Coord* closestPoint=nullptr;
+    m_root->closestPoint(x, y, distSQ, closestPoint);
+    return (closestPoint)?*closestPoint:Coord();
+  }
+
+  //################################################################################################
+  //! Find the k closest coords to the point
+  /*!
+  \param x - The x coord of the point to search from.
+  \param y - The y coord of the point to search from.
+  \param k - The maximum number of coords to return.
+  \param distSQ - Limits the search radius, once k coords have been found this is updated with the \
+         distance to the furthest of them.
+  \param results - Populated with the closest coords sorted by distance.
+  */
+  void kClosestPoints(Scalar x, Scalar y, int k, double& distSQ, std::vector<CoordDistance>& results) const
+  {
+    m_root->kClosestPoints(x, y, k, distSQ, results);
+  }
+
+  //################################################################################################
+  int size() const
+  {
+    return m_count;
+  }
+
+private:
+  QuadTreeExactTemplate(const QuadTreeExactTemplate&)=delete;
+  QuadTreeExactTemplate& operator=(const QuadTreeExactTemplate&)=delete;
+
+  //################################################################################################
+  //! Returns a-b as a double, for integer types the subtraction is exact and can not overflow
+  static double diff(Scalar a, Scalar b)
+  {
+    if constexpr(std::is_integral<Scalar>::value)
+      return (a<b)?-double(uint64_t(b)-uint64_t(a)):double(uint64_t(a)-uint64_t(b));
+    else
+      return a-b;
+  }
+
+  //################################################################################################
+  //! Returns the point half way between lo and hi rounded once, without overflowing
+  static Scalar mid(Scalar lo, Scalar hi)
+  {
+    if constexpr(std::is_integral<Scalar>::value)
+      return Scalar(lo + Scalar((uint64_t(hi)-uint64_t(lo))/2));
+    else
+      return lo + (hi-lo)*Scalar(0.5);
+  }
+
+  //################################################################################################
+  struct Cell
+  {
+    TP_NONCOPYABLE(Cell);
+    std::vector<Coord> coords;
+
+    //0=x0 y0
+    //1=x1 y0
+    //2=x0 y1
+    //3=x1 y1
+    std::unique_ptr<Cell[]> children;
+
+    Scalar minX{0};
+    Scalar maxX{0};
+    Scalar minY{0};
+    Scalar maxY{0};
+
+    //The split point, coords with x<cx go to the x0 children.
+    Scalar cx{0};
+    Scalar cy{0};
+
+    int cellSize{20};
+
+    //##############################################################################################
+    Cell()=default;
+
+    //##############################################################################################
+    Cell(Scalar minX_, Scalar maxX_, Scalar minY_, Scalar maxY_, int cellSize_)
+    {
+      setBounds(minX_, maxX_, minY_, maxY_, cellSize_);
+    }
+
+    //##############################################################################################
+    void setBounds(Scalar minX_, Scalar maxX_, Scalar minY_, Scalar maxY_, int cellSize_)
+    {
+      minX = minX_;
+      maxX = maxX_;
+      minY = minY_;
+      maxY = maxY_;
+      cx = mid(minX, maxX);
+      cy = mid(minY, maxY);
+      cellSize = cellSize_;
+    }
+
+    //##############################################################################################
+    int findChild(Scalar x, Scalar y) const
+    {
+      //0=x0 y0
+      //1=x1 y0
+      //2=x0 y1
+      //3=x1 y1
+      return (x<cx)?((y<cy)?0:2):((y<cy)?1:3);
+    }
+
+    //##############################################################################################
+    void addCoord(const Coord& coord)
+    {
+      if(!children)
+      {
+        coords.push_back(coord);
+
+        //Only split if the split point lies strictly inside the cell on both axes, once it does
+        //not the resolution of Scalar has been exhausted.
+        if(int(coords.size())>cellSize && cx>minX && cx<maxX && cy>minY && cy<maxY)
+        {
+          children.reset(new Cell[4]);
+          children[0].setBounds(minX, cx, minY, cy, cellSize);
+          children[1].setBounds(cx, maxX, minY, cy, cellSize);
+          children[2].setBounds(minX, cx, cy, maxY, cellSize);
+          children[3].setBounds(cx, maxX, cy, maxY, cellSize);
+
+          for(const Coord& c : coords)
+            children[findChild(c.x, c.y)].addCoord(c);
+
+          coords.clear();
+          coords.shrink_to_fit();
+        }
+      }
+      else
+        children[findChild(coord.x, coord.y)].addCoord(coord);
+    }
+
+    //##############################################################################################
+    template<typename Leaf>
+    void visit(Scalar x, Scalar y, double& distSQ, const Leaf& leaf) const
+    {
+      if(children)
+      {
+        double dx = diff(cx, x);
+        dx*=dx;
+        double dy = diff(cy, y);
+        dy*=dy;
+
+        detail::visitClosestChildFirst(findChild(x, y), dx, dy, distSQ, [&](int q)
+        {
+          children[q].visit(x, y, distSQ, leaf);
+        });
+      }
+      else
+      {
+        const Coord* c = coords.data();
+        const Coord* cMax = c + coords.size();
+        for(;c<cMax; c++)
+        {
+          double dx = diff(c->x, x);
+          double dy = diff(c->y, y);
+          double nDist = (dx*dx) + (dy*dy);
+          if(nDist<distSQ)
+            leaf(c, nDist);
+        }
+      }
+    }
+
+    //##############################################################################################
+    void closestPoint(Scalar x, Scalar y, double& distSQ, const Coord*& closestPoint) const
+    {
+      visit(x, y, distSQ, [&](const Coord* c, double nDist)
+      {
+        closestPoint = c;
+        distSQ = nDist;
+      });
+    }
+
+    //##############################################################################################
+    void kClosestPoints(Scalar x, Scalar y, int k, double& distSQ, std::vector<CoordDistance>& results) const
+    {
+      visit(x, y, distSQ, [&](const Coord* c, double nDist)
+      {
+        detail::insertClosest(CoordDistance(c, nDist), k, distSQ, results);
+      });
+    }
+  };
+
+  std::unique_ptr<Cell> m_root;
+  int m_count{0};
+};
+
+//##################################################################################################
+template<typename T>
+using QuadTreeDoubleTemplate = QuadTreeExactTemplate<double, T>;
+
+//##################################################################################################
+template<typename T>
+using QuadTreeInt64Template = QuadTreeExactTemplate<int64_t, T>;
+
+}
+
+#endif
@@ -3,6 +3,9 @@
 
 #include "tp_quad_tree/Globals.h" // IWYU pragma: keep
 
+#include <vector>
+#include <utility>
+
 namespace tp_quad_tree
 {
 
@@ -26,6 +29,20 @@ public:
     }
   };
 
+  //################################################################################################
+  struct CoordDistance
+  {
+    const Coord* coord;
+    float distSQ;
+
+    CoordDistance(const Coord* coord_=nullptr, float distSQ_=0.0f):
+      coord(coord_),
+      distSQ(distSQ_)
+    {
+
+    }
+  };
+
   //################################################################################################
   //! Construct an empty quad tree
   /*!
@@ -53,6 +70,22 @@ public:
   */
   void addCoord(const Coord& coord);
 
+  //################################################################################################
+  //! Move every coord in the tree to a new position
+  /*!
+  This is intended for simulations where every coord moves a little each frame. The existing cells
+  are kept, coords that are still inside their leaf are updated in place and only those that have
+  left it are removed and added again. Leaves that overflow are split as usual, and subtrees that
+  end up holding no more than half a cell of coords are merged back into their parent.
+
+  The order that coords were added in is only recorded once this has been called, so the first call
+  rebuilds the tree from the new positions and later calls update it in place.
+
+  \param newPositions - The new position of each coord, indexed in the order that the coords were
+         added with addCoord(), there must be one for every coord in the tree.
+  */
+  void updateAll(const Coord* newPositions);
+
   //################################################################################################
   //! Find the closes coord to the point
   /*!
@@ -65,12 +98,95 @@ public:
   */
   Coord closestPoint(const Coord& point, float& distSQ);
 
+  //################################################################################################
+  //! Find the k closest coords to the point
+  /*!
+  \param point - The point to find the nearest points to.
+  \param k - The maximum number of coords to return.
+  \param distSQ - Limits the search radius, once k coords have been found this is updated with the \
+         distance to the furthest of them.
+  \param results - Populated with the closest coords sorted by distance.
+  */
+  void kClosestPoints(const Coord& point, int k, float& distSQ, std::vector<CoordDistance>& results);
+
+  //################################################################################################
+  //! Find all the coords inside a rectangle
+  /*!
+  In periodic mode the rectangle may extend past the bounds of the tree, the part that does will
+  wrap around to the other side.
+
+  \param min - The minimum corner of the rectangle, inclusive.
+  \param max - The maximum corner of the rectangle, inclusive.
+  \param results - The coords inside the rectangle are appended to this.
+  */
+  void coordsInRect(const Coord& min, const Coord& max, std::vector<Coord>& results);
+
+  //################################################################################################
+  //! Treat the bounds of the tree as a periodic (toroidal) domain
+  /*!
+  In periodic mode coords added outside the bounds are wrapped into them, and distances are
+  measured to the nearest image of each coord, so a coord near one edge can be the closest to a
+  point near the opposite edge. This replaces the need to insert ghost copies of coords near the
+  edges. The period on each axis is the extent of the bounds passed to the constructor. Each axis is
+  independent, with only one axis periodic coords and queries are left as they are on the other.
+
+  \param periodicX - True if the x axis should wrap around.
+  \param periodicY - True if the y axis should wrap around.
+  */
+  void setPeriodic(bool periodicX, bool periodicY);
+
+  //################################################################################################
+  //! Treat coords as longitude (x) and latitude (y) in degrees and measure great circle distances
+  /*!
+  In geographic mode closestPoint() and kClosestPoints() rank coords by great circle distance and
+  distSQ is the square of the central angle between the points in radians, multiply the square root
+  by the radius of the sphere to get a distance. Cells are still longitude/latitude boxes but they
+  are pruned using the exact great circle distance from the point to the box, so results are
+  correct away from the equator and across the antimeridian. This takes precedence over periodic
+  mode, coordsInRect() is not affected.
+
+  \param geographic - True to use great circle distances.
+  */
+  void setGeographic(bool geographic);
+
 private:
   QuadTreeFloat(const QuadTreeFloat&);
   QuadTreeFloat& operator=(const QuadTreeFloat&);
 
+  //################################################################################################
+  template<typename Search>
+  void searchImages(const Coord& point, float& distSQ, const Search& search);
+
+  //################################################################################################
+  //! Visit the leaves in order of great circle distance from the point, see setGeographic()
+  template<typename Leaf>
+  void searchGreatCircle(const Coord& point, float& distSQ, const Leaf& leaf);
+
+  //################################################################################################
+  float wrap(float v, float min, float max) const;
+
+  //################################################################################################
+  //! Wrap each periodic axis of a coord into the bounds, non-periodic axes are left as they are
+  Coord wrapCoord(const Coord& coord) const;
+
   struct Cell;
   Cell* m_root;
+  int m_count{0};
+
+  //False until updateAll() is first called, until then the cells do not store the order that
+  //coords were added in so that trees that are never updated do not pay for it.
+  bool m_trackIds{false};
+
+  //Coords that have left their leaf during updateAll(), kept to reuse the allocation.
+  std::vector<std::pair<Coord, int>> m_moved;
+
+  float m_minX;
+  float m_maxX;
+  float m_minY;
+  float m_maxY;
+  bool m_periodicX{false};
+  bool m_periodicY{false};
+  bool m_geographic{false};
 };
 
 }
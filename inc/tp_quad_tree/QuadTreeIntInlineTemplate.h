@@ -0,0 +1,336 @@
+#ifndef tp_quad_tree_QuadTreeIntInlineTemplate_h
+#define tp_quad_tree_QuadTreeIntInlineTemplate_h
+
+#include "tp_quad_tree/Globals.h" // IWYU pragma: keep
+#include "tp_quad_tree/QuadTreePolicies.h"
+
+#include "tp_utils/Globals.h"
+
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+namespace tp_quad_tree
+{
+
+//##################################################################################################
+//! A quad tree with a compile time leaf capacity and coords stored inline in the leaves
+/*!
+QuadTreeIntTemplate stores the coords of each cell in a std::vector, so visiting a leaf means
+following a pointer to a separate heap block, and internal cells keep an empty vector around after
+they split. This tree uses two distinct node types instead. Internal nodes only hold the split point
+and references to their four children. Leaves hold their coords in a fixed size array inside the
+node. Both are kept in contiguous pools and referenced by index, so there is no allocation per cell
+and the memory used per coord is predictable.
+
+Cells are split at their centre in the same way as QuadTreeIntTemplate with SplitPolicy::Centre.
+Once a leaf has reached the minimum cell size and is full, further coords go into overflow leaves
+chained from it.
+
+\tparam T - The type of value stored with each coord.
+\tparam LeafCapacity - The maximum number of coords in a leaf.
+*/
+template<typename T, int LeafCapacity=16>
+class QuadTreeIntInlineTemplate
+{
+  static_assert(LeafCapacity>0, "LeafCapacity must be greater than 0");
+public:
+
+  //################################################################################################
+  struct Coord
+  {
+    int x;
+    int y;
+
+    T value;
+
+    //##############################################################################################
+    Coord(int x_=0, int y_=0, const T& value_=T()):
+      x(x_),
+      y(y_),
+      value(value_)
+    {
+
+    }
+  };
+
+  //################################################################################################
+  struct CoordDistance
+  {
+    const Coord* coord;
+    int distSQ;
+
+    CoordDistance(const Coord* coord_=nullptr, int distSQ_=0):
+      coord(coord_),
+      distSQ(distSQ_)
+    {
+
+    }
+  };
+
+  //################################################################################################
+  //! Construct an empty quad tree
+  /*!
+  \param minX - The minimum x value
+  \param maxX - The maximum x value
+  \param minY - The minimum y value
+  \param maxY - The maximum y value
+  */
+  QuadTreeIntInlineTemplate(int minX, int maxX, int minY, int maxY)
+  {
+    int radX = (maxX-minX)/2;
+    int radY = (maxY-minY)/2;
+    m_root = leafRef(newLeaf(minX+radX, minY+radY, radX, radY));
+  }
+
+  //################################################################################################
+  //! Add a coordinate to the tree
+  /*!
+  This will add a coordinate to the tree, this will divide cells as required.
+
+  \param coord - The coordinate to add.
+  */
+  void addCoord(const Coord& coord)
+  {
+    m_root = addCoord(m_root, coord);
+    m_count++;
+  }
+
+  //################################################################################################
+  //! Find the closes coord to the point
+  /*!
+  \param x - The x coord of the point to search from.
+  \param y - The y coord of the point to search from.
+  \param distSQ - This will be updated with the distance to the closest coord the initial value \
+         will limit the search radius.
+  \return The coord if one is found, else a null Coord.
+  */
+  Coord closestPoint(int x, int y, int& distSQ) const
+  {
+    const Coord* closestPoint=nullptr;
+    visit(m_root, x, y, distSQ, [&](const Coord* c, int nDist)
+    {
+      closestPoint = c;
+      distSQ = nDist;
+    });
+    return (closestPoint)?*closestPoint:Coord();
+  }
+
+  //################################################################################################
+  //! Find the k closest coords to the point
+  /*!
+  \param x - The x coord of the point to search from.
+  \param y - The y coord of the point to search from.
+  \param k - The maximum number of coords to return.
+  \param distSQ - Limits the search radius, once k coords have been found this is updated with the \
+         distance to the furthest of them.
+  \param results - Populated with the closest coords sorted by distance.
+  */
+  void kClosestPoints(int x, int y, int k, int& distSQ, std::vector<CoordDistance>& results) const
+  {
+    visit(m_root, x, y, distSQ, [&](const Coord* c, int nDist)
+    {
+      detail::insertClosest(CoordDistance(c, nDist), k, distSQ, results);
+    });
+  }
+
+  //################################################################################################
+  int size() const
+  {
+    return m_count;
+  }
+
+  //################################################################################################
+  //! Returns the number of bytes allocated for nodes
+  size_t memoryUsage() const
+  {
+    return m_internals.capacity()*sizeof(Internal) + m_leaves.capacity()*sizeof(Leaf);
+  }
+
+private:
+  //The top bit of a node reference marks it as a leaf, the rest is an index into the pool.
+  static constexpr uint32_t leafBit = 0x80000000u;
+  static constexpr uint32_t noLeaf = 0xFFFFFFFFu;
+
+  //################################################################################################
+  struct Internal
+  {
+    //The split point, coords with x<cx go to the x0 children.
+    int cx;
+    int cy;
+
+    //0=x0 y0
+    //1=x1 y0
+    //2=x0 y1
+    //3=x1 y1
+    uint32_t children[4];
+  };
+
+  //################################################################################################
+  struct Leaf
+  {
+    int cx;
+    int cy;
+    int radX;
+    int radY;
+    int count{0};
+
+    //The next leaf in the overflow chain of a minimum size cell, or noLeaf.
+    uint32_t overflow{noLeaf};
+
+    std::array<Coord, LeafCapacity> coords;
+  };
+
+  //################################################################################################
+  static bool isLeaf(uint32_t ref)
+  {
+    return ref & leafBit;
+  }
+
+  //################################################################################################
+  static uint32_t leafRef(uint32_t index)
+  {
+    return index | leafBit;
+  }
+
+  //################################################################################################
+  static int findChild(const Internal& node, int x, int y)
+  {
+    //0=x0 y0
+    //1=x1 y0
+    //2=x0 y1
+    //3=x1 y1
+    return (x<node.cx)?((y<node.cy)?0:2):((y<node.cy)?1:3);
+  }
+
+  //################################################################################################
+  uint32_t newLeaf(int cx, int cy, int radX, int radY)
+  {
+    uint32_t index = uint32_t(m_leaves.size());
+    m_leaves.emplace_back();
+    Leaf& leaf = m_leaves.back();
+    leaf.cx = cx;
+    leaf.cy = cy;
+    leaf.radX = radX;
+    leaf.radY = radY;
+    return index;
+  }
+
+  //################################################################################################
+  //! Add a coord below a node, returns the node that should replace it
+  uint32_t addCoord(uint32_t ref, const Coord& coord)
+  {
+    if(!isLeaf(ref))
+    {
+      int q = findChild(m_internals[ref], coord.x, coord.y);
+      uint32_t child = addCoord(m_internals[ref].children[q], coord);
+      m_internals[ref].children[q] = child;
+      return ref;
+    }
+
+    uint32_t index = ref & ~leafBit;
+    if(m_leaves[index].count<LeafCapacity)
+    {
+      Leaf& leaf = m_leaves[index];
+      leaf.coords[size_t(leaf.count++)] = coord;
+      return ref;
+    }
+
+    int cx   = m_leaves[index].cx;
+    int cy   = m_leaves[index].cy;
+    int radX = m_leaves[index].radX;
+    int radY = m_leaves[index].radY;
+    int nRadX = radX/2;
+    int nRadY = radY/2;
+
+    //The cell can't be split any further, add the coord to the last leaf in its overflow chain.
+    if(nRadX<=1 || nRadY<=1)
+    {
+      uint32_t last = index;
+      while(m_leaves[last].overflow!=noLeaf)
+        last = m_leaves[last].overflow;
+
+      if(m_leaves[last].count==LeafCapacity)
+      {
+        uint32_t next = newLeaf(cx, cy, radX, radY);
+        m_leaves[last].overflow = next;
+        last = next;
+      }
+
+      Leaf& leaf = m_leaves[last];
+      leaf.coords[size_t(leaf.count++)] = coord;
+      return ref;
+    }
+
+    //Split the leaf, its slot in the pool is reused for the first child.
+    std::array<Coord, LeafCapacity> coords = m_leaves[index].coords;
+
+    uint32_t node = uint32_t(m_internals.size());
+    m_internals.emplace_back();
+    m_internals[node].cx = cx;
+    m_internals[node].cy = cy;
+
+    m_leaves[index] = Leaf();
+    m_leaves[index].cx = cx-nRadX;
+    m_leaves[index].cy = cy-nRadY;
+    m_leaves[index].radX = nRadX;
+    m_leaves[index].radY = nRadY;
+
+    m_internals[node].children[0] = leafRef(index);
+    m_internals[node].children[1] = leafRef(newLeaf(cx+nRadX, cy-nRadY, nRadX, nRadY));
+    m_internals[node].children[2] = leafRef(newLeaf(cx-nRadX, cy+nRadY, nRadX, nRadY));
+    m_internals[node].children[3] = leafRef(newLeaf(cx+nRadX, cy+nRadY, nRadX, nRadY));
+
+    for(const Coord& c : coords)
+      addCoord(node, c);
+
+    addCoord(node, coord);
+    return node;
+  }
+
+  //################################################################################################
+  template<typename Visitor>
+  void visit(uint32_t ref, int x, int y, int& distSQ, const Visitor& visitor) const
+  {
+    if(!isLeaf(ref))
+    {
+      const Internal& node = m_internals[ref];
+
+      int dx = node.cx-x;
+      dx*=dx;
+      int dy = node.cy-y;
+      dy*=dy;
+
+      detail::visitClosestChildFirst(findChild(node, x, y), dx, dy, distSQ, [&](int q)
+      {
+        visit(node.children[q], x, y, distSQ, visitor);
+      });
+      return;
+    }
+
+    for(uint32_t index = ref & ~leafBit; index!=noLeaf; index=m_leaves[index].overflow)
+    {
+      const Leaf& leaf = m_leaves[index];
+      const Coord* c = leaf.coords.data();
+      const Coord* cMax = c + leaf.count;
+      for(;c<cMax; c++)
+      {
+        int dx = c->x-x;
+        int dy = c->y-y;
+        int nDist = (dx*dx) + (dy*dy);
+        if(nDist<distSQ)
+          visitor(c, nDist);
+      }
+    }
+  }
+
+  std::vector<Internal> m_internals;
+  std::vector<Leaf> m_leaves;
+  uint32_t m_root{0};
+  int m_count{0};
+};
+
+}
+
+#endif
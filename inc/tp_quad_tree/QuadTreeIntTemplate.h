@@ -2,16 +2,34 @@
 #define tp_quad_tree_QuadTreeIntTemplate_h
 
 #include "tp_quad_tree/Globals.h" // IWYU pragma: keep
+#include "tp_quad_tree/QuadTreePolicies.h"
+#include "tp_quad_tree/QueryCache.h"
+#include "tp_quad_tree/Trace.h"
+#include "tp_quad_tree/SegmentDistance.h"
 
 #include "tp_utils/Globals.h"
 
 #include <vector>
+#include <memory>
+#include <queue>
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <cmath>
 
 namespace tp_quad_tree
 {
 
 //##################################################################################################
-template<typename T>
+/*!
+\tparam T - The type of value stored with each coord.
+\tparam Categories - An optional category policy, see NoCategories.
+\tparam Aggregate - An optional aggregate policy, see NoAggregate.
+\tparam Metric - The distance metric used by the nearest searches, see EuclideanMetric.
+*/
+template<typename T, typename Categories=NoCategories, typename Aggregate=NoAggregate, typename Metric=EuclideanMetric>
 class QuadTreeIntTemplate
 {
 public:
@@ -48,6 +66,19 @@ public:
     }
   };
 
+  //################################################################################################
+  //! Shape statistics, see stats()
+  struct Stats
+  {
+    int cells{0};
+    int leaves{0};
+    int emptyLeaves{0};
+    int maxDepth{0};
+    int maxLeafSize{0};
+    double averageLeafDepth{0.0};
+    double averageLeafSize{0.0};
+  };
+
   //################################################################################################
   //! Construct an empty quad tree
   /*!
@@ -62,7 +93,9 @@ public:
   \param cellSize - The maximum number of coords in a cell
   */
   QuadTreeIntTemplate(int minX, int maxX, int minY, int maxY, int cellSize):
-    m_root(new Cell(cellSize))
+    m_root(std::make_shared<Cell>(cellSize)),
+    m_minX(minX),
+    m_minY(minY)
   {
     m_root->radX = (maxX-minX)/2;
     m_root->radY = (maxY-minY)/2;
@@ -71,10 +104,7 @@ public:
   }
 
   //################################################################################################
-  ~QuadTreeIntTemplate()
-  {
-    delete m_root;
-  }
+  ~QuadTreeIntTemplate()=default;
 
   //################################################################################################
   //! Add a coordinate to the tree
@@ -85,8 +115,119 @@ public:
   */
   void addCoord(const Coord& coord)
   {
-    m_root->addCoord(coord);
+    uint64_t generation = m_generation.load(std::memory_order_relaxed);
+    if(m_root->generation!=generation)
+      m_root = m_root->clone(generation);
+
+    m_root->addCoord(coord, m_splitConfig, 0, generation);
     m_count++;
+    m_version++;
+
+    if(m_queryCache)
+      m_queryCache->coordAdded(coord.x, coord.y);
+  }
+
+  //################################################################################################
+  //! Cache the results of closestPoint() for repeated queries
+  /*!
+  Once enabled closestPoint() without a predicate first looks up the quantized query location in
+  the cache, a hit returns the cached coord without traversing the tree. addCoord() invalidates only
+  the entries that the new coord is closer to than their cached result. See QueryCache for details.
+
+  The cache is modified by closestPoint() so queries on a tree with a cache must not be made from
+  multiple threads at once, use a Snapshot for that.
+
+  \param quantum - The size of the square query locations are quantized to, 1 for exact results.
+         Larger values return approximate results, see QueryCache.
+  \param capacity - The number of entries in the cache.
+  */
+  void enableQueryCache(int quantum=1, size_t capacity=4096)
+  {
+    m_queryCache = std::make_unique<QueryCache<Coord, Metric>>(quantum, capacity);
+  }
+
+  //################################################################################################
+  void disableQueryCache()
+  {
+    m_queryCache.reset();
+  }
+
+  //################################################################################################
+  //! Returns the hit, miss, and invalidation counters of the query cache
+  QueryCacheStats queryCacheStats() const
+  {
+    return m_queryCache?m_queryCache->stats():QueryCacheStats();
+  }
+
+  //################################################################################################
+  //! Set how leaves choose where to split
+  /*!
+  The default Centre policy splits each leaf into four equal quadrants. On clustered data this
+  produces chains of cells where most children are empty, the Median and Compressed policies choose
+  the split point from the coords in the leaf instead so that each split separates them. This only
+  affects splits that happen after it is called.
+
+  \param splitPolicy - The policy to use for future splits.
+  */
+  void setSplitPolicy(SplitPolicy splitPolicy)
+  {
+    m_splitConfig.policy = splitPolicy;
+  }
+
+  //################################################################################################
+  //! Set the maximum number of coords in a leaf as a function of its depth
+  /*!
+  By default every cell uses the cellSize passed to the constructor. The root is at depth 0, this
+  only affects cells created after it is called.
+
+  \param leafCapacity - Returns the cell size for a cell at the given depth.
+  */
+  void setLeafCapacity(const std::function<int(int depth)>& leafCapacity)
+  {
+    m_splitConfig.leafCapacity = leafCapacity;
+  }
+
+  //################################################################################################
+  //! Rebuild the cells of the tree into a compact layout
+  /*!
+  After many calls to addCoord() the cells are scattered across the heap in insertion order and many
+  leaves hold far fewer coords than they have reserved. This copies the tree into a single block of
+  cells laid out in depth first order, shrinks each leaf to fit its coords, and collapses subtrees
+  that hold no more coords than their cell size back into a single leaf. Query results are not
+  changed, this is intended to be run during quiet periods to restore the query performance of a
+  freshly built tree.
+
+  Snapshots taken before compact() are not affected, they keep the old cells.
+
+  The block is only freed as a whole, once the tree has been compacted again or destroyed and every
+  snapshot taken since this call has been released. Cells that addCoord() replaces with copies after
+  a snapshot are not returned to the heap before then, so a tree that takes frequent snapshots should
+  be compacted periodically to reclaim them.
+  */
+  void compact()
+  {
+    std::shared_ptr<Cell[]> pool(new Cell[m_root->compactedCellCount()]);
+    size_t next=0;
+
+    auto root = std::make_shared<Cell>(m_root->cellSize);
+    root->compactFrom(*m_root, m_splitConfig, m_minX, m_minY, pool.get(), next, m_generation.load(std::memory_order_relaxed));
+    m_root = root;
+    m_pool = pool;
+    m_version++;
+  }
+
+  //################################################################################################
+  //! Returns statistics describing the shape of the tree
+  Stats stats() const
+  {
+    Stats stats;
+    m_root->stats(stats, 0);
+    if(stats.leaves>0)
+    {
+      stats.averageLeafDepth /= double(stats.leaves);
+      stats.averageLeafSize = double(m_count) / double(stats.leaves);
+    }
+    return stats;
   }
 
   //################################################################################################
@@ -101,15 +242,264 @@ public:
   */
   Coord closestPoint(int x, int y, int& distSQ)
   {
+    TP_QUAD_TREE_TRACE_SCOPE(Query);
+
+    if(m_queryCache)
+    {
+      //With a quantum larger than 1 the cached coord is only the closest to the query that
+      //populated the entry, if it is outside distSQ of this query another coord may not be so the
+      //cache treats it as a miss.
+      if(const Coord* cached = m_queryCache->find(x, y, distSQ); cached)
+        return *cached;
+    }
+
+    const Coord* closestPoint=nullptr;
+    m_root->closestPoint(x, y, distSQ, closestPoint, AcceptAll(), ~uint64_t(0));
+
+    if(m_queryCache && closestPoint)
+      m_queryCache->insert(x, y, *closestPoint, distSQ);
+
+    return (closestPoint)?*closestPoint:Coord();
+  }
+
+  //################################################################################################
+  //! Find the closest coord to the point that matches a predicate
+  /*!
+  The predicate is evaluated in the leaf loop so coords that do not match never become candidates
+  and do not shrink the search radius. If a category policy is in use, subtrees that do not contain
+  any of the requested categories are skipped without being visited.
+
+  \param x - The x coord of the point to search from.
+  \param y - The y coord of the point to search from.
+  \param distSQ - Updated with the distance to the closest matching coord, limits the search.
+  \param predicate - Called with each candidate Coord, return true to accept it.
+  \param categories - Only coords whose category mask intersects this are considered.
+  \return The coord if one is found, else a null Coord.
+  */
+  template<typename Predicate>
+  Coord closestPoint(int x, int y, int& distSQ, const Predicate& predicate, uint64_t categories=~uint64_t(0))
+  {
+    TP_QUAD_TREE_TRACE_SCOPE(Query);
     const Coord* closestPoint=nullptr;
-    m_root->closestPoint(x, y, distSQ, closestPoint);
+    m_root->closestPoint(x, y, distSQ, closestPoint, predicate, categories);
     return (closestPoint)?*closestPoint:Coord();
   }
 
   //################################################################################################
   void kClosestPoints(int x, int y, int k, int& distSQ, std::vector<CoordDistance>& results)
   {
-    m_root->kClosestPoints(x, y, k, distSQ, results);
+    TP_QUAD_TREE_TRACE_SCOPE(Query);
+    m_root->kClosestPoints(x, y, k, distSQ, results, AcceptAll(), ~uint64_t(0));
+  }
+
+  //################################################################################################
+  //! Find the k closest coords to the point that match a predicate
+  /*!
+  See the predicate version of closestPoint() for details of the filtering.
+  */
+  template<typename Predicate>
+  void kClosestPoints(int x, int y, int k, int& distSQ, std::vector<CoordDistance>& results, const Predicate& predicate, uint64_t categories=~uint64_t(0))
+  {
+    TP_QUAD_TREE_TRACE_SCOPE(Query);
+    m_root->kClosestPoints(x, y, k, distSQ, results, predicate, categories);
+  }
+
+  //################################################################################################
+  //! Find the closest coord to a line segment
+  /*!
+  Cells are pruned by their distance to the segment and coords are tested by their distance to the
+  closest point on the segment, so this replaces sampling points along the segment with a single
+  traversal. Distances are always Euclidean regardless of the Metric.
+
+  \param x0 - The x coord of the start of the segment.
+  \param y0 - The y coord of the start of the segment.
+  \param x1 - The x coord of the end of the segment.
+  \param y1 - The y coord of the end of the segment.
+  \param distSQ - Updated with the squared distance to the closest coord, limits the search.
+  \return The coord if one is found, else a null Coord.
+  */
+  Coord closestPointToSegment(int x0, int y0, int x1, int y1, double& distSQ) const
+  {
+    const Segment segment(x0, y0, x1, y1);
+    return closestPointToSegments(&segment, 1, distSQ);
+  }
+
+  //################################################################################################
+  //! Find the closest coord to a polyline
+  /*!
+  The polyline is searched in a single traversal, each cell only tests the segments that could
+  contain a closer point than the best found so far. A polyline with a single point is treated as a
+  point.
+
+  \param polyline - The vertices of the polyline, only the x and y of each Coord are used.
+  \param distSQ - Updated with the squared distance to the closest coord, limits the search.
+  \return The coord if one is found, else a null Coord.
+  */
+  Coord closestPointToPolyline(const std::vector<Coord>& polyline, double& distSQ) const
+  {
+    std::vector<Segment> segments;
+    if(polyline.size()==1)
+      segments.emplace_back(polyline.front().x, polyline.front().y, polyline.front().x, polyline.front().y);
+
+    for(size_t i=1; i<polyline.size(); i++)
+      segments.emplace_back(polyline.at(i-1).x, polyline.at(i-1).y, polyline.at(i).x, polyline.at(i).y);
+
+    return closestPointToSegments(segments.data(), segments.size(), distSQ);
+  }
+
+  //################################################################################################
+  //! Calculate the distance to the closest coord for every pixel of a grid
+  /*!
+  Rather than searching from every pixel the grid is processed in tiles. For each tile the closest
+  coord to its centre gives an upper bound on the distance from any pixel in the tile, every coord
+  that could be closest to one of its pixels is then gathered in a single traversal and the pixels
+  are tested against only those candidates. Tiles with too many candidates are subdivided. Tiles are
+  shared between threads.
+
+  Pixel centres are at minX+(i+0.5)*(maxX-minX)/width and likewise for y. Distances are Euclidean
+  regardless of the Metric, and are the distance rather than the squared distance. If the tree is
+  empty every pixel is set to infinity.
+
+  \param minX - The left edge of the grid.
+  \param maxX - The right edge of the grid.
+  \param minY - The top edge of the grid.
+  \param maxY - The bottom edge of the grid.
+  \param width - The number of pixels across the grid.
+  \param height - The number of pixels down the grid.
+  \param out - Populated with width*height distances, row by row.
+  \param threads - The number of threads to use, 0 to use the number of hardware threads.
+  */
+  void distanceField(int minX, int maxX, int minY, int maxY, int width, int height, float* out, int threads=0) const
+  {
+    if(width<1 || height<1)
+      return;
+
+    FieldGrid grid;
+    grid.minX = minX;
+    grid.minY = minY;
+    grid.stepX = (double(maxX)-double(minX))/width;
+    grid.stepY = (double(maxY)-double(minY))/height;
+    grid.width = width;
+    grid.out = out;
+
+    const int tilesX = (width+fieldTileSize-1)/fieldTileSize;
+    const int tilesY = (height+fieldTileSize-1)/fieldTileSize;
+    const int tiles = tilesX*tilesY;
+
+    std::atomic<int> next{0};
+    auto worker = [&]
+    {
+      FieldScratch scratch;
+      for(int t=next++; t<tiles; t=next++)
+      {
+        int px = (t%tilesX)*fieldTileSize;
+        int py = (t/tilesX)*fieldTileSize;
+        distanceFieldTile(grid, px, py, std::min(fieldTileSize, width-px), std::min(fieldTileSize, height-py), scratch);
+      }
+    };
+
+    if(threads<1)
+      threads = std::max(1, int(std::thread::hardware_concurrency()));
+    threads = std::min(threads, tiles);
+
+    std::vector<std::thread> pool;
+    for(int i=1; i<threads; i++)
+      pool.emplace_back(worker);
+    worker();
+    for(std::thread& thread : pool)
+      thread.join();
+  }
+
+  //################################################################################################
+  class QueryCursor;
+
+  //################################################################################################
+  //! Find the closest coord to the point starting from the leaf used by the previous query
+  /*!
+  This is intended for queries that move a small distance between calls, for example following a
+  trajectory. The cursor remembers the path to the leaf that contained the last query point, the
+  search starts from the deepest cell on that path that contains the new point and then expands
+  upwards only as far as the current best distance requires.
+
+  If the cursor was last used with a different tree, or the tree has been modified since, the search
+  starts from the root.
+
+  \param cursor - Holds the path from the previous query, start with a default constructed cursor.
+  \param x - The x coord of the point to search from.
+  \param y - The y coord of the point to search from.
+  \param distSQ - This will be updated with the distance to the closest coord the initial value \
+         will limit the search radius.
+  \return The coord if one is found, else a null Coord.
+  */
+  Coord closestPoint(QueryCursor& cursor, int x, int y, int& distSQ) const
+  {
+    if(cursor.m_version != m_version || cursor.m_path.empty() || !cursor.sameRoot(m_root))
+    {
+      cursor.m_path.clear();
+      cursor.m_path.emplace_back(m_root.get(), 0, Cell::minBound, Cell::maxBound, Cell::minBound, Cell::maxBound);
+      cursor.m_root = m_root;
+      cursor.m_version = m_version;
+    }
+
+    const Coord* closestPoint=nullptr;
+    cursor.closestPoint(x, y, distSQ, closestPoint);
+    return (closestPoint)?*closestPoint:Coord();
+  }
+
+  //################################################################################################
+  class NearestIterator;
+
+  //################################################################################################
+  //! Browse the coords in order of increasing distance from a point
+  /*!
+  This returns a lazy iterator that yields coords one at a time closest first, this allows the
+  caller to stop as soon as an acceptable coord is found rather than choosing k up front.
+
+  \param x - The x coord of the point to search from.
+  \param y - The y coord of the point to search from.
+  \param maxDistSQ - Coords further than this will not be returned.
+  \return An iterator, call next() on it to fetch coords.
+  */
+  NearestIterator nearest(int x, int y, int maxDistSQ=std::numeric_limits<int>::max()) const
+  {
+    return NearestIterator(m_root, m_pool, x, y, maxDistSQ);
+  }
+
+  //################################################################################################
+  //! Count the coords inside a rectangle
+  /*!
+  Each cell knows how many coords are below it, so cells that are entirely inside the rectangle are
+  counted without being descended into, only cells that cross the edge of the rectangle are visited.
+
+  \param minX - The minimum x value, inclusive.
+  \param maxX - The maximum x value, inclusive.
+  \param minY - The minimum y value, inclusive.
+  \param maxY - The maximum y value, inclusive.
+  \return The number of coords inside the rectangle.
+  */
+  int countInRect(int minX, int maxX, int minY, int maxY) const
+  {
+    int count=0;
+    m_root->visitRect(minX, maxX, minY, maxY, Cell::minBound, Cell::maxBound, Cell::minBound, Cell::maxBound,
+                      [&](const Cell& cell){count+=cell.count;},
+                      [&](const Coord&){count++;});
+    return count;
+  }
+
+  //################################################################################################
+  //! Combine the values of the coords inside a rectangle using the Aggregate policy
+  /*!
+  This works like countInRect() but combines the aggregate that each cell holds for its subtree.
+  Only available if an Aggregate policy is enabled.
+  */
+  template<typename A=Aggregate>
+  typename A::Value aggregateInRect(int minX, int maxX, int minY, int maxY) const
+  {
+    typename A::Value result = A::identity();
+    m_root->visitRect(minX, maxX, minY, maxY, Cell::minBound, Cell::maxBound, Cell::minBound, Cell::maxBound,
+                      [&](const Cell& cell){result = A::combine(result, cell.aggregate);},
+                      [&](const Coord& coord){result = A::combine(result, A::lift(coord.value));});
+    return result;
   }
 
   //################################################################################################
@@ -118,31 +508,94 @@ public:
     return m_count;
   }
 
+  //################################################################################################
+  class Snapshot;
+
+  //################################################################################################
+  //! Take an immutable snapshot of the current state of the tree
+  /*!
+  The snapshot shares all of its cells with the tree, taking one is O(1). After a snapshot has been
+  taken addCoord() copies the cells on the path from the root to the leaf that it modifies, rather
+  than modifying them in place, so the snapshot never changes. This allows readers on other threads
+  to query a consistent version of the tree without locking while the writer continues to add
+  coords, the memory cost is proportional to the number of paths modified.
+
+  Each snapshot starts a new generation of the tree, addCoord() only modifies cells that were
+  created in the current generation in place. This does not depend on the reference counts of the
+  cells so snapshots can be released on any thread. snapshot() must not be called at the same time
+  as addCoord(), but while the tree is not being modified it can be called from several threads.
+
+  Cells are freed when the last tree or snapshot referencing them is destroyed.
+  */
+  Snapshot snapshot() const
+  {
+    m_generation.fetch_add(1, std::memory_order_relaxed);
+    return Snapshot(m_root, m_pool, m_count);
+  }
+
 private:
   QuadTreeIntTemplate(const QuadTreeIntTemplate&)=delete;
   QuadTreeIntTemplate& operator=(const QuadTreeIntTemplate&)=delete;
 
+  //################################################################################################
+  struct SplitConfig
+  {
+    SplitPolicy policy{SplitPolicy::Centre};
+    std::function<int(int)> leafCapacity;
+  };
+
   //##################################################################################################
-  struct Cell
+  struct Cell : public detail::CategoryStorage<Categories::enabled>, public detail::AggregateStorage<Aggregate>
   {
     TP_NONCOPYABLE(Cell);
+
+    //##############################################################################################
+    //! The four children of a cell
+    /*!
+    Each child is held by its own pointer so that it can be shared with snapshots independently of
+    its siblings, addCoord() only has to copy the child on the path that it modifies.
+    */
+    struct Children
+    {
+      std::shared_ptr<Cell> cells[4];
+
+      explicit operator bool() const
+      {
+        return bool(cells[0]);
+      }
+
+      Cell& operator[](int i) const
+      {
+        return *cells[i];
+      }
+    };
+
     std::vector<Coord> coords;
 
     //0=x0 y0
     //1=x1 y0
     //2=x0 y1
     //3=x1 y1
-    Cell* children;
+    Children children;
+
+    //For leaves cx and cy are the centre of the cell, for internal cells they are the split point.
 
     int radX;
     int radY;
     int cx;
     int cy;
     int cellSize;
+    int count{0};
+
+    //The generation of the tree that created this cell, the tree only modifies cells from its
+    //current generation in place, see QuadTreeIntTemplate::snapshot().
+    uint64_t generation{0};
+
+    static constexpr int minBound = std::numeric_limits<int>::min();
+    static constexpr int maxBound = std::numeric_limits<int>::max();
 
     //################################################################################################
     Cell(int cellSize_=20):
-      children(nullptr),
       radX(0),
       radY(0),
       cx(0),
@@ -153,13 +606,115 @@ private:
     }
 
     //################################################################################################
-    ~Cell()
+    //! Copy this cell into the given generation, the children are shared with the copy not duplicated
+    std::shared_ptr<Cell> clone(uint64_t generation_) const
     {
-      delete[] children;
+      auto cell = std::make_shared<Cell>(cellSize);
+      cell->copyFrom(*this);
+      cell->generation = generation_;
+      return cell;
     }
 
     //################################################################################################
-    int findChild(int x, int y)
+    void copyFrom(const Cell& other)
+    {
+      static_cast<detail::CategoryStorage<Categories::enabled>&>(*this) = other;
+      static_cast<detail::AggregateStorage<Aggregate>&>(*this) = other;
+      coords = other.coords;
+      children = other.children;
+      radX = other.radX;
+      radY = other.radY;
+      cx = other.cx;
+      cy = other.cy;
+      cellSize = other.cellSize;
+      count = other.count;
+    }
+
+    //################################################################################################
+    //! Returns the number of cells below this one once underfull subtrees have been collapsed
+    size_t compactedCellCount() const
+    {
+      if(!children || count<=cellSize)
+        return 0;
+
+      size_t n=4;
+      for(int i=0; i<4; i++)
+        n += children[i].compactedCellCount();
+      return n;
+    }
+
+    //################################################################################################
+    //! Copy other into this cell, allocating child blocks from the pool in depth first order
+    /*!
+    The child pointers into the pool do not own it, the pool is held by the tree and its snapshots
+    instead. This avoids a reference cycle.
+
+    loX and loY are the lower bounds of the cell, a collapsed subtree gets back the centre it had as
+    a leaf, rather than keeping its split point, so that it splits the same way again.
+    */
+    void compactFrom(const Cell& other, const SplitConfig& config, int loX, int loY, Cell* pool, size_t& next, uint64_t generation_)
+    {
+      generation = generation_;
+      static_cast<detail::CategoryStorage<Categories::enabled>&>(*this) = other;
+      static_cast<detail::AggregateStorage<Aggregate>&>(*this) = other;
+      radX = other.radX;
+      radY = other.radY;
+      cx = other.cx;
+      cy = other.cy;
+      cellSize = other.cellSize;
+      count = other.count;
+
+      if(other.children && other.count>other.cellSize)
+      {
+        for(int i=0; i<4; i++)
+          children.cells[i] = std::shared_ptr<Cell>(std::shared_ptr<Cell>(), pool+next+i);
+        next+=4;
+
+        for(int i=0; i<4; i++)
+          children[i].compactFrom(other.children[i], config, (i&1)?cx:loX, (i&2)?cy:loY, pool, next, generation_);
+      }
+      else
+      {
+        //With the centre policy the split point is already the centre of the cell.
+        if(other.children && config.policy != SplitPolicy::Centre)
+        {
+          cx = loX+radX;
+          cy = loY+radY;
+        }
+
+        coords.reserve(size_t(count));
+        other.collectCoords(coords);
+      }
+    }
+
+    //################################################################################################
+    void collectCoords(std::vector<Coord>& results) const
+    {
+      if(children)
+      {
+        for(int i=0; i<4; i++)
+          children[i].collectCoords(results);
+      }
+      else
+        results.insert(results.end(), coords.begin(), coords.end());
+    }
+
+    //################################################################################################
+    //! Returns child q, first replacing it with a copy if it is from an older generation
+    /*!
+    Cells from older generations may be shared with snapshots so they are never modified, the copy
+    shares its own children with the original. This cell must already be from the current generation.
+    */
+    Cell& detachChild(int q, uint64_t generation_)
+    {
+      std::shared_ptr<Cell>& child = children.cells[q];
+      if(child->generation!=generation_)
+        child = child->clone(generation_);
+      return *child;
+    }
+
+    //################################################################################################
+    int findChild(int x, int y) const
     {
       //0=x0 y0
       //1=x1 y0
@@ -169,174 +724,319 @@ private:
     }
 
     //################################################################################################
-    void addCoord(const Coord& coord)
+    void addCoord(const Coord& coord, const SplitConfig& config, int depth, uint64_t generation_)
     {
+      count++;
+
+      if constexpr(Categories::enabled)
+        this->categoryMask |= Categories::mask(coord.value);
+
+      if constexpr(Aggregate::enabled)
+        this->aggregate = Aggregate::combine(this->aggregate, Aggregate::lift(coord.value));
+
       if(!children)
       {
         coords.push_back(coord);
         if(int(coords.size())>cellSize)
+          split(config, depth, generation_);
+      }
+      else
+        detachChild(findChild(coord.x, coord.y), generation_).addCoord(coord, config, depth+1, generation_);
+    }
+
+    //################################################################################################
+    void split(const SplitConfig& config, int depth, uint64_t generation_)
+    {
+      int sx = cx;
+      int sy = cy;
+
+      if(config.policy == SplitPolicy::Centre)
+      {
+        if(radX/2<=1 || radY/2<=1)
+          return;
+      }
+      else
+      {
+        int minX=coords.front().x;
+        int maxX=minX;
+        int minY=coords.front().y;
+        int maxY=minY;
+        for(const Coord& c : coords)
+        {
+          minX = std::min(minX, c.x);
+          maxX = std::max(maxX, c.x);
+          minY = std::min(minY, c.y);
+          maxY = std::max(maxY, c.y);
+        }
+
+        //All the coords are the same, grow the leaf rather than trying to split it again on the
+        //next insert, this keeps repeated inserts of the same coord amortized O(1).
+        if(minX==maxX && minY==maxY)
         {
-          int nRadX = radX/2;
-          int nRadY = radY/2;
+          cellSize = int(coords.size())*2;
+          return;
+        }
+
+        sx = int(minX + (int64_t(maxX)-minX+1)/2);
+        sy = int(minY + (int64_t(maxY)-minY+1)/2);
 
-          if(nRadX>1 && nRadY>1)
+        if(config.policy == SplitPolicy::Median)
+        {
+          //Fall back to the centre of the bounding box if the median is the minimum, as that would
+          //not separate the coords.
+          auto median = [&](auto get, int min, int fallback)
           {
-            children = new Cell[4];
-
-            children[0].radX = nRadX;
-            children[0].radY = nRadY;
-            children[0].cx = cx - nRadX;
-            children[0].cy = cy - nRadY;
-            children[0].cellSize = cellSize;
-            children[0].coords.reserve(cellSize);
-
-            children[1].radX = nRadX;
-            children[1].radY = nRadY;
-            children[1].cx = cx + nRadX;
-            children[1].cy = cy - nRadY;
-            children[1].cellSize = cellSize;
-            children[1].coords.reserve(cellSize);
-
-            children[2].radX = nRadX;
-            children[2].radY = nRadY;
-            children[2].cx = cx - nRadX;
-            children[2].cy = cy + nRadY;
-            children[2].cellSize = cellSize;
-            children[2].coords.reserve(cellSize);
-
-            children[3].radX = nRadX;
-            children[3].radY = nRadY;
-            children[3].cx = cx + nRadX;
-            children[3].cy = cy + nRadY;
-            children[3].cellSize = cellSize;
-            children[3].coords.reserve(cellSize);
-
-            const Coord* c = coords.data();
-            const Coord* cMax = c + coords.size();
-            for(;c<cMax; c++)
-              addCoord(*c);
-
-            coords.clear();
-          }
+            std::vector<int> values;
+            values.reserve(coords.size());
+            for(const Coord& c : coords)
+              values.push_back(get(c));
+            auto m = values.begin() + values.size()/2;
+            std::nth_element(values.begin(), m, values.end());
+            return (*m>min)?*m:fallback;
+          };
+
+          sx = median([](const Coord& c){return c.x;}, minX, sx);
+          sy = median([](const Coord& c){return c.y;}, minY, sy);
         }
       }
+
+      int loX = cx-radX;
+      int hiX = cx+radX;
+      int loY = cy-radY;
+      int hiY = cy+radY;
+      int childCellSize = config.leafCapacity?config.leafCapacity(depth+1):cellSize;
+
+      for(int i=0; i<4; i++)
+      {
+        children.cells[i] = std::make_shared<Cell>(childCellSize);
+        Cell& child = children[i];
+        child.generation = generation_;
+        int cLoX = (i&1)?sx:loX;
+        int cHiX = (i&1)?hiX:sx;
+        int cLoY = (i&2)?sy:loY;
+        int cHiY = (i&2)?hiY:sy;
+
+        if(config.policy == SplitPolicy::Centre)
+        {
+          child.radX = radX/2;
+          child.radY = radY/2;
+          child.cx = (i&1)?(cx+child.radX):(cx-child.radX);
+          child.cy = (i&2)?(cy+child.radY):(cy-child.radY);
+        }
+        else
+        {
+          child.radX = int((int64_t(cHiX)-cLoX)/2);
+          child.radY = int((int64_t(cHiY)-cLoY)/2);
+          child.cx = cLoX+child.radX;
+          child.cy = cLoY+child.radY;
+        }
+
+        child.coords.reserve(size_t(childCellSize));
+      }
+
+      cx = sx;
+      cy = sy;
+
+      const Coord* c = coords.data();
+      const Coord* cMax = c + coords.size();
+      for(;c<cMax; c++)
+        children[findChild(c->x, c->y)].addCoord(*c, config, depth+1, generation_);
+
+      coords.clear();
+    }
+
+    //################################################################################################
+    void stats(Stats& stats, int depth) const
+    {
+      stats.cells++;
+      stats.maxDepth = std::max(stats.maxDepth, depth);
+
+      if(children)
+      {
+        for(int i=0; i<4; i++)
+          children[i].stats(stats, depth+1);
+      }
       else
-        children[findChild(coord.x, coord.y)].addCoord(coord);
+      {
+        stats.leaves++;
+        if(coords.empty())
+          stats.emptyLeaves++;
+        stats.maxLeafSize = std::max(stats.maxLeafSize, int(coords.size()));
+        stats.averageLeafDepth += double(depth);
+      }
     }
 
     //################################################################################################
-    void closestPoint(int x, int y, int& distSQ, const Coord*& closestPoint)
+    //! Visit the parts of the tree that are inside a rectangle
+    /*!
+    The lo/hi bounds are the region of the plane that is routed to this cell, cells entirely inside
+    the rectangle are passed to whole(), coords from leaves that cross the edge are passed to part().
+    */
+    template<typename Whole, typename Part>
+    void visitRect(int minX, int maxX, int minY, int maxY,
+                   int loX, int hiX, int loY, int hiY,
+                   const Whole& whole, const Part& part) const
+    {
+      if(count==0 || loX>maxX || hiX<minX || loY>maxY || hiY<minY)
+        return;
+
+      if(loX>=minX && hiX<=maxX && loY>=minY && hiY<=maxY)
+      {
+        whole(*this);
+        return;
+      }
+
+      if(children)
+      {
+        children[0].visitRect(minX, maxX, minY, maxY, loX, cx-1, loY, cy-1, whole, part);
+        children[1].visitRect(minX, maxX, minY, maxY, cx, hiX, loY, cy-1, whole, part);
+        children[2].visitRect(minX, maxX, minY, maxY, loX, cx-1, cy, hiY, whole, part);
+        children[3].visitRect(minX, maxX, minY, maxY, cx, hiX, cy, hiY, whole, part);
+      }
+      else
+      {
+        const Coord* c = coords.data();
+        const Coord* cMax = c + coords.size();
+        for(;c<cMax; c++)
+          if(c->x>=minX && c->x<=maxX && c->y>=minY && c->y<=maxY)
+            part(*c);
+      }
+    }
+
+    //################################################################################################
+    template<typename Predicate>
+    static bool matches(const Coord& coord, const Predicate& predicate, uint64_t categories)
     {
+      if constexpr(Categories::enabled)
+        if(!(Categories::mask(coord.value) & categories))
+          return false;
+
+      return predicate(coord);
+    }
+
+    //################################################################################################
+    template<typename Predicate>
+    void closestPoint(int x, int y, int& distSQ, const Coord*& closestPoint, const Predicate& predicate, uint64_t categories) const
+    {
+      if constexpr(Categories::enabled)
+        if(!(this->categoryMask & categories))
+          return;
+
       if(children)
       {
+        //Visit the child containing the point first, then the neighbour across x, then the
+        //neighbour across y, and finally the diagonal, pruning each against the split lines. The
+        //other trees use the same order through detail::visitClosestChildFirst().
         if(x<cx)
         {
           int dx = cx-x;
-          dx*=dx;
+          dx = Metric::boundX(dx);
 
           if(y<cy)
           {
             int dy = cy-y;
-            dy*=dy;
+            dy = Metric::boundY(dy);
 
             //0=x0 y0 <--
             //1=x1 y0
             //2=x0 y1
             //3=x1 y1
 
-            children[0].closestPoint(x, y, distSQ, closestPoint);
+            children[0].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
 
             if(dx<distSQ)
-              children[1].closestPoint(x, y, distSQ, closestPoint);
+              children[1].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
 
             if(dy<distSQ)
-              children[2].closestPoint(x, y, distSQ, closestPoint);
+              children[2].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
 
-            if((dx+dy)<distSQ)
-              children[3].closestPoint(x, y, distSQ, closestPoint);
+            if(Metric::combine(dx, dy)<distSQ)
+              children[3].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
           }
           else
           {
             int dy = y-cy;
-            dy*=dy;
+            dy = Metric::boundY(dy);
 
             //0=x0 y0
             //1=x1 y0
             //2=x0 y1 <--
             //3=x1 y1
 
-            children[2].closestPoint(x, y, distSQ, closestPoint);
+            children[2].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
 
             if(dx<distSQ)
-              children[3].closestPoint(x, y, distSQ, closestPoint);
+              children[3].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
 
             if(dy<distSQ)
-              children[0].closestPoint(x, y, distSQ, closestPoint);
+              children[0].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
 
-            if((dx+dy)<distSQ)
-              children[1].closestPoint(x, y, distSQ, closestPoint);
+            if(Metric::combine(dx, dy)<distSQ)
+              children[1].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
           }
         }
         else
         {
           int dx = x-cx;
-          dx*=dx;
+          dx = Metric::boundX(dx);
 
           if(y<cy)
           {
             int dy = cy-y;
-            dy*=dy;
+            dy = Metric::boundY(dy);
 
             //0=x0 y0
             //1=x1 y0 <--
             //2=x0 y1
             //3=x1 y1
 
-            children[1].closestPoint(x, y, distSQ, closestPoint);
+            children[1].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
 
             if(dx<distSQ)
-              children[0].closestPoint(x, y, distSQ, closestPoint);
+              children[0].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
 
             if(dy<distSQ)
-              children[3].closestPoint(x, y, distSQ, closestPoint);
+              children[3].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
 
-            if((dx+dy)<distSQ)
-              children[2].closestPoint(x, y, distSQ, closestPoint);
+            if(Metric::combine(dx, dy)<distSQ)
+              children[2].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
           }
           else
           {
             int dy = y-cy;
-            dy*=dy;
+            dy = Metric::boundY(dy);
 
             //0=x0 y0
             //1=x1 y0
             //2=x0 y1
             //3=x1 y1 <--
 
-            children[3].closestPoint(x, y, distSQ, closestPoint);
+            children[3].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
 
             if(dx<distSQ)
-              children[2].closestPoint(x, y, distSQ, closestPoint);
+              children[2].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
 
             if(dy<distSQ)
-              children[1].closestPoint(x, y, distSQ, closestPoint);
+              children[1].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
 
-            if((dx+dy)<distSQ)
-              children[0].closestPoint(x, y, distSQ, closestPoint);
+            if(Metric::combine(dx, dy)<distSQ)
+              children[0].closestPoint(x, y, distSQ, closestPoint, predicate, categories);
           }
         }
       }
       else
       {
+        TP_QUAD_TREE_TRACE_SCOPE(LeafScan);
         const Coord* c = coords.data();
         const Coord* cMax = c + coords.size();
         for(;c<cMax; c++)
         {
           int dx = c->x-x;
           int dy = c->y-y;
-          int nDist = (dx*dx) + (dy*dy);
-          if(nDist<distSQ)
+          int nDist = Metric::distance(dx, dy);
+          if(nDist<distSQ && matches(*c, predicate, categories))
           {
+            TP_QUAD_TREE_TRACE_COUNT(ResultUpdate);
             closestPoint = c;
             distSQ = nDist;
           }
@@ -345,135 +1045,719 @@ private:
     }
 
     //##############################################################################################
-    void kClosestPoints(int x, int y, int k, int& distSQ, std::vector<CoordDistance>& results)
+    template<typename Predicate>
+    void kClosestPoints(int x, int y, int k, int& distSQ, std::vector<CoordDistance>& results, const Predicate& predicate, uint64_t categories) const
     {
+      if constexpr(Categories::enabled)
+        if(!(this->categoryMask & categories))
+          return;
+
       if(children)
       {
         if(x<cx)
         {
           int dx = cx-x;
-          dx*=dx;
+          dx = Metric::boundX(dx);
 
           if(y<cy)
           {
             int dy = cy-y;
-            dy*=dy;
+            dy = Metric::boundY(dy);
 
             //0=x0 y0 <--
             //1=x1 y0
             //2=x0 y1
             //3=x1 y1
 
-            children[0].kClosestPoints(x, y, k, distSQ, results);
+            children[0].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
 
             if(dx<distSQ)
-              children[1].kClosestPoints(x, y, k, distSQ, results);
+              children[1].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
 
             if(dy<distSQ)
-              children[2].kClosestPoints(x, y, k, distSQ, results);
+              children[2].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
 
-            if((dx+dy)<distSQ)
-              children[3].kClosestPoints(x, y, k, distSQ, results);
+            if(Metric::combine(dx, dy)<distSQ)
+              children[3].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
           }
           else
           {
             int dy = y-cy;
-            dy*=dy;
+            dy = Metric::boundY(dy);
 
             //0=x0 y0
             //1=x1 y0
             //2=x0 y1 <--
             //3=x1 y1
 
-            children[2].kClosestPoints(x, y, k, distSQ, results);
+            children[2].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
 
             if(dx<distSQ)
-              children[3].kClosestPoints(x, y, k, distSQ, results);
+              children[3].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
 
             if(dy<distSQ)
-              children[0].kClosestPoints(x, y, k, distSQ, results);
+              children[0].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
 
-            if((dx+dy)<distSQ)
-              children[1].kClosestPoints(x, y, k, distSQ, results);
+            if(Metric::combine(dx, dy)<distSQ)
+              children[1].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
           }
         }
         else
         {
           int dx = x-cx;
-          dx*=dx;
+          dx = Metric::boundX(dx);
 
           if(y<cy)
           {
             int dy = cy-y;
-            dy*=dy;
+            dy = Metric::boundY(dy);
 
             //0=x0 y0
             //1=x1 y0 <--
             //2=x0 y1
             //3=x1 y1
 
-            children[1].kClosestPoints(x, y, k, distSQ, results);
+            children[1].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
 
             if(dx<distSQ)
-              children[0].kClosestPoints(x, y, k, distSQ, results);
+              children[0].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
 
             if(dy<distSQ)
-              children[3].kClosestPoints(x, y, k, distSQ, results);
+              children[3].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
 
-            if((dx+dy)<distSQ)
-              children[2].kClosestPoints(x, y, k, distSQ, results);
+            if(Metric::combine(dx, dy)<distSQ)
+              children[2].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
           }
           else
           {
             int dy = y-cy;
-            dy*=dy;
+            dy = Metric::boundY(dy);
 
             //0=x0 y0
             //1=x1 y0
             //2=x0 y1
             //3=x1 y1 <--
 
-            children[3].kClosestPoints(x, y, k, distSQ, results);
+            children[3].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
 
             if(dx<distSQ)
-              children[2].kClosestPoints(x, y, k, distSQ, results);
+              children[2].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
 
             if(dy<distSQ)
-              children[1].kClosestPoints(x, y, k, distSQ, results);
+              children[1].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
 
-            if((dx+dy)<distSQ)
-              children[0].kClosestPoints(x, y, k, distSQ, results);
+            if(Metric::combine(dx, dy)<distSQ)
+              children[0].kClosestPoints(x, y, k, distSQ, results, predicate, categories);
           }
         }
       }
       else
       {
+        TP_QUAD_TREE_TRACE_SCOPE(LeafScan);
         const Coord* c = coords.data();
         const Coord* cMax = c + coords.size();
         for(;c<cMax; c++)
         {
           int dx = c->x-x;
           int dy = c->y-y;
-          int nDist = (dx*dx) + (dy*dy);
+          int nDist = Metric::distance(dx, dy);
+
+          if(!matches(*c, predicate, categories))
+            continue;
+
+          TP_QUAD_TREE_TRACE_COUNT(ResultUpdate);
+          detail::insertClosest(CoordDistance(c, nDist), k, distSQ, results);
+        }
+      }
+    }
+
+    //##############################################################################################
+    //! Append the coords within sqrt(radiusSQ) of a point, returns false if there are more than limit
+    bool coordsInRadius(double x, double y, double radiusSQ, double loX, double hiX, double loY, double hiY,
+                        size_t limit, std::vector<const Coord*>& results) const
+    {
+      if(count==0 || detail::pointBoxDistSQ(x, y, loX, hiX, loY, hiY)>radiusSQ)
+        return true;
+
+      if(children)
+      {
+        for(int q=0; q<4; q++)
+          if(!children[q].coordsInRadius(x, y, radiusSQ,
+                                         (q&1)?cx:loX, (q&1)?hiX:cx,
+                                         (q&2)?cy:loY, (q&2)?hiY:cy,
+                                         limit, results))
+            return false;
+        return true;
+      }
+
+      for(const Coord& c : coords)
+      {
+        double dx = c.x-x;
+        double dy = c.y-y;
+        if((dx*dx) + (dy*dy) <= radiusSQ)
+        {
+          if(results.size()>=limit)
+            return false;
+          results.push_back(&c);
+        }
+      }
+      return true;
+    }
+
+    //##############################################################################################
+    //! Search for the closest coord to a set of segments
+    /*!
+    The indices of the segments that are still within distSQ of this cell are appended to active,
+    the parent's activeCount segments start at first. They are removed again before returning.
+    */
+    void closestPointToSegments(const Segment* segments, std::vector<uint32_t>& active, size_t first, size_t activeCount,
+                                double loX, double hiX, double loY, double hiY,
+                                double& distSQ, const Coord*& closestPoint) const
+    {
+      size_t begin = active.size();
+      for(size_t i=first; i<first+activeCount; i++)
+      {
+        uint32_t s = active[i];
+        if(detail::segmentBoxDistSQ(segments[s], loX, hiX, loY, hiY)<distSQ)
+          active.push_back(s);
+      }
+
+      size_t n = active.size()-begin;
+      if(n==0)
+        return;
+
+      if(children)
+      {
+        //Visit the children closest first so that the search radius shrinks as early as possible.
+        double bounds[4];
+        int order[4]={0, 1, 2, 3};
+        for(int q=0; q<4; q++)
+        {
+          bounds[q] = std::numeric_limits<double>::infinity();
+          for(size_t i=begin; i<begin+n; i++)
+            bounds[q] = std::min(bounds[q], detail::segmentBoxDistSQ(segments[active[i]],
+                                                                     (q&1)?cx:loX, (q&1)?hiX:cx,
+                                                                     (q&2)?cy:loY, (q&2)?hiY:cy));
+        }
+        std::sort(order, order+4, [&](int a, int b){return bounds[a]<bounds[b];});
+
+        for(int q : order)
+        {
+          if(bounds[q]<distSQ)
+            children[q].closestPointToSegments(segments, active, begin, n,
+                                               (q&1)?cx:loX, (q&1)?hiX:cx,
+                                               (q&2)?cy:loY, (q&2)?hiY:cy,
+                                               distSQ, closestPoint);
+        }
+      }
+      else
+      {
+        for(const Coord& c : coords)
+        {
+          for(size_t i=begin; i<begin+n; i++)
+          {
+            double nDist = detail::pointSegmentDistSQ(c.x, c.y, segments[active[i]]);
+            if(nDist<distSQ)
+            {
+              closestPoint = &c;
+              distSQ = nDist;
+            }
+          }
+        }
+      }
+
+      active.resize(begin);
+    }
+  };
+
+public:
+  //################################################################################################
+  //! Yields coords in increasing distance order, see nearest()
+  /*!
+  This is an incremental nearest neighbour search (distance browsing), a priority queue holds both
+  cells and coords keyed by distance. Cells are keyed by a lower bound of the distance to any coord
+  they contain, and are only expanded when they reach the front of the queue. Coords are returned
+  when they reach the front, at that point nothing left in the queue can be closer.
+
+  The iterator shares the cells it was created from, so an iterator from a Snapshot remains valid
+  after the snapshot is destroyed. An iterator from the tree itself must not be used once the tree
+  has been modified.
+  */
+  class NearestIterator
+  {
+  public:
+    //##############################################################################################
+    //! Returns the next closest coord, or nullptr once all coords within range have been returned
+    /*!
+    \param distSQ - Set to the squared distance of the returned coord.
+    */
+    const Coord* next(int& distSQ)
+    {
+      while(!m_queue.empty())
+      {
+        Item item = m_queue.top();
+        m_queue.pop();
 
-          int i=results.size();
-          for(; i>0 && nDist<results.at(i-1).distSQ; i--){}
-          results.insert(results.begin()+i, CoordDistance(c, nDist));
+        if(item.coord)
+        {
+          distSQ = item.distSQ;
+          return item.coord;
+        }
 
-          if(int(results.size())>k)
+        const Cell* cell = item.cell;
+        if(cell->children)
+        {
+          int dx = cell->cx-m_x;
+          dx = Metric::boundX(dx);
+          int dy = cell->cy-m_y;
+          dy = Metric::boundY(dy);
+
+          //The child on the same side of a split line as the point keeps the parent's gap on that
+          //axis, the child on the far side is at least as far as the split line.
+          int gapX0 = (m_x<cell->cx)?item.gapX:std::max(item.gapX, dx);
+          int gapX1 = (m_x<cell->cx)?std::max(item.gapX, dx):item.gapX;
+          int gapY0 = (m_y<cell->cy)?item.gapY:std::max(item.gapY, dy);
+          int gapY1 = (m_y<cell->cy)?std::max(item.gapY, dy):item.gapY;
+
+          pushCell(&cell->children[0], gapX0, gapY0);
+          pushCell(&cell->children[1], gapX1, gapY0);
+          pushCell(&cell->children[2], gapX0, gapY1);
+          pushCell(&cell->children[3], gapX1, gapY1);
+        }
+        else
+        {
+          const Coord* c = cell->coords.data();
+          const Coord* cMax = c + cell->coords.size();
+          for(;c<cMax; c++)
           {
-            const CoordDistance& b = results.back();
-            if(b.distSQ<distSQ)
-              distSQ=b.distSQ;
-            results.pop_back();
+            int dx = c->x-m_x;
+            int dy = c->y-m_y;
+            int nDist = Metric::distance(dx, dy);
+            if(nDist<=m_maxDistSQ)
+              m_queue.push(Item(nDist, 0, 0, nullptr, c));
           }
         }
       }
+
+      return nullptr;
     }
+
+  private:
+    friend class QuadTreeIntTemplate;
+
+    //##############################################################################################
+    struct Item
+    {
+      int distSQ;
+      int gapX;
+      int gapY;
+      const Cell* cell;
+      const Coord* coord;
+
+      Item(int distSQ_, int gapX_, int gapY_, const Cell* cell_, const Coord* coord_):
+        distSQ(distSQ_),
+        gapX(gapX_),
+        gapY(gapY_),
+        cell(cell_),
+        coord(coord_)
+      {
+
+      }
+
+      //! Orders the queue closest first, coords before cells at the same distance.
+      bool operator<(const Item& other) const
+      {
+        if(distSQ != other.distSQ)
+          return distSQ>other.distSQ;
+        return !coord && other.coord;
+      }
+    };
+
+    //##############################################################################################
+    NearestIterator(const std::shared_ptr<const Cell>& root, const std::shared_ptr<Cell[]>& pool, int x, int y, int maxDistSQ):
+      m_root(root),
+      m_pool(pool),
+      m_x(x),
+      m_y(y),
+      m_maxDistSQ(maxDistSQ)
+    {
+      if(m_root)
+        m_queue.push(Item(0, 0, 0, m_root.get(), nullptr));
+    }
+
+    //##############################################################################################
+    void pushCell(const Cell* cell, int gapX, int gapY)
+    {
+      int distSQ = Metric::combine(gapX, gapY);
+      if(distSQ<=m_maxDistSQ && (cell->children || !cell->coords.empty()))
+        m_queue.push(Item(distSQ, gapX, gapY, cell, nullptr));
+    }
+
+    std::shared_ptr<const Cell> m_root; //!< Keeps the cells in the queue alive.
+    std::shared_ptr<Cell[]> m_pool;
+    int m_x;
+    int m_y;
+    int m_maxDistSQ;
+    std::priority_queue<Item> m_queue;
   };
 
-  Cell* m_root;
+public:
+  //################################################################################################
+  //! Remembers the path to the leaf used by the last query, see closestPoint(QueryCursor&, ...)
+  class QueryCursor
+  {
+  public:
+    //##############################################################################################
+    QueryCursor()=default;
+
+  private:
+    friend class QuadTreeIntTemplate;
+
+    //##############################################################################################
+    //! A cell on the path and the region of the plane routed to it, lo is inclusive and hi is
+    //! exclusive, minBound and maxBound mean the region is unbounded on that side.
+    struct PathEntry
+    {
+      const Cell* cell;
+      int q; //!< The index of this cell in its parent's children.
+      int loX;
+      int hiX;
+      int loY;
+      int hiY;
+
+      PathEntry(const Cell* cell_, int q_, int loX_, int hiX_, int loY_, int hiY_):
+        cell(cell_),
+        q(q_),
+        loX(loX_),
+        hiX(hiX_),
+        loY(loY_),
+        hiY(hiY_)
+      {
+
+      }
+
+      //! Returns true if the point is routed to this cell
+      bool contains(int x, int y) const
+      {
+        return (loX==Cell::minBound || x>=loX) && (hiX==Cell::maxBound || x<hiX) &&
+               (loY==Cell::minBound || y>=loY) && (hiY==Cell::maxBound || y<hiY);
+      }
+
+      //! Returns true if no point outside this cell can be closer than distSQ
+      bool containsCircle(int x, int y, int distSQ) const
+      {
+        return (loX==Cell::minBound || Metric::boundX(x-loX)>=distSQ) && (hiX==Cell::maxBound || Metric::boundX(hiX-x)>=distSQ) &&
+               (loY==Cell::minBound || Metric::boundY(y-loY)>=distSQ) && (hiY==Cell::maxBound || Metric::boundY(hiY-y)>=distSQ);
+      }
+    };
+
+    //##############################################################################################
+    void closestPoint(int x, int y, int& distSQ, const Coord*& closestPoint)
+    {
+      //Move up to the deepest cell on the previous path that contains the point.
+      while(m_path.size()>1 && !m_path.back().contains(x, y))
+        m_path.pop_back();
+
+      //Move down to the leaf that contains the point.
+      for(;;)
+      {
+        const PathEntry& entry = m_path.back();
+        const Cell* cell = entry.cell;
+        if(!cell->children)
+          break;
+
+        int q = cell->findChild(x, y);
+        m_path.emplace_back(&cell->children[q], q,
+                            (q&1)?cell->cx:entry.loX,
+                            (q&1)?entry.hiX:cell->cx,
+                            (q&2)?cell->cy:entry.loY,
+                            (q&2)?entry.hiY:cell->cy);
+      }
+
+      m_path.back().cell->closestPoint(x, y, distSQ, closestPoint, AcceptAll(), ~uint64_t(0));
+
+      //Expand upwards, at each level search the siblings of the cell we came from until the
+      //circle of the current best distance lies inside the cell that has been searched.
+      for(size_t i=m_path.size()-1; i>0; i--)
+      {
+        if(m_path.at(i).containsCircle(x, y, distSQ))
+          return;
+
+        const Cell* parent = m_path.at(i-1).cell;
+        const auto& children = parent->children;
+        int q = m_path.at(i).q;
+
+        int dx = parent->cx-x;
+        dx = Metric::boundX(dx);
+        int dy = parent->cy-y;
+        dy = Metric::boundY(dy);
+
+        if(dx<distSQ)
+          children[q^1].closestPoint(x, y, distSQ, closestPoint, AcceptAll(), ~uint64_t(0));
+
+        if(dy<distSQ)
+          children[q^2].closestPoint(x, y, distSQ, closestPoint, AcceptAll(), ~uint64_t(0));
+
+        if(Metric::combine(dx, dy)<distSQ)
+          children[q^3].closestPoint(x, y, distSQ, closestPoint, AcceptAll(), ~uint64_t(0));
+      }
+    }
+
+    //##############################################################################################
+    //! Returns true if root is the root the path was taken from
+    /*!
+    This compares the control blocks, the weak pointer keeps the cursor's block allocated so a
+    different tree can not share its address, and it avoids the atomic operations of lock().
+    */
+    bool sameRoot(const std::shared_ptr<Cell>& root) const
+    {
+      return !m_root.owner_before(root) && !root.owner_before(m_root);
+    }
+
+    std::vector<PathEntry> m_path;
+    std::weak_ptr<Cell> m_root; //!< The root of the tree the path was taken from.
+    uint64_t m_version{0};
+  };
+
+public:
+  //################################################################################################
+  //! An immutable version of the tree, see snapshot()
+  /*!
+  Snapshots are cheap to copy and safe to query from any thread, coords returned by pointer remain
+  valid for as long as the snapshot is held.
+  */
+  class Snapshot
+  {
+  public:
+    //##############################################################################################
+    Snapshot()=default;
+
+    //##############################################################################################
+    //! See QuadTreeIntTemplate::closestPoint()
+    Coord closestPoint(int x, int y, int& distSQ) const
+    {
+      return closestPoint(x, y, distSQ, AcceptAll());
+    }
+
+    //##############################################################################################
+    //! See QuadTreeIntTemplate::closestPoint()
+    template<typename Predicate>
+    Coord closestPoint(int x, int y, int& distSQ, const Predicate& predicate, uint64_t categories=~uint64_t(0)) const
+    {
+      const Coord* closestPoint=nullptr;
+      if(m_root)
+        m_root->closestPoint(x, y, distSQ, closestPoint, predicate, categories);
+      return (closestPoint)?*closestPoint:Coord();
+    }
+
+    //##############################################################################################
+    //! See QuadTreeIntTemplate::kClosestPoints()
+    void kClosestPoints(int x, int y, int k, int& distSQ, std::vector<CoordDistance>& results) const
+    {
+      kClosestPoints(x, y, k, distSQ, results, AcceptAll());
+    }
+
+    //##############################################################################################
+    //! See QuadTreeIntTemplate::kClosestPoints()
+    template<typename Predicate>
+    void kClosestPoints(int x, int y, int k, int& distSQ, std::vector<CoordDistance>& results, const Predicate& predicate, uint64_t categories=~uint64_t(0)) const
+    {
+      if(m_root)
+        m_root->kClosestPoints(x, y, k, distSQ, results, predicate, categories);
+    }
+
+    //##############################################################################################
+    //! See QuadTreeIntTemplate::nearest()
+    NearestIterator nearest(int x, int y, int maxDistSQ=std::numeric_limits<int>::max()) const
+    {
+      return NearestIterator(m_root, m_pool, x, y, maxDistSQ);
+    }
+
+    //##############################################################################################
+    //! See QuadTreeIntTemplate::countInRect()
+    int countInRect(int minX, int maxX, int minY, int maxY) const
+    {
+      int count=0;
+      if(m_root)
+        m_root->visitRect(minX, maxX, minY, maxY, Cell::minBound, Cell::maxBound, Cell::minBound, Cell::maxBound,
+                          [&](const Cell& cell){count+=cell.count;},
+                          [&](const Coord&){count++;});
+      return count;
+    }
+
+    //##############################################################################################
+    int size() const
+    {
+      return m_count;
+    }
+
+  private:
+    friend class QuadTreeIntTemplate;
+
+    //##############################################################################################
+    Snapshot(const std::shared_ptr<const Cell>& root, const std::shared_ptr<Cell[]>& pool, int count):
+      m_root(root),
+      m_pool(pool),
+      m_count(count)
+    {
+
+    }
+
+    std::shared_ptr<const Cell> m_root;
+    std::shared_ptr<Cell[]> m_pool;
+    int m_count{0};
+  };
+
+private:
+  //The size of the tiles used by distanceField(), and the number of candidates a tile can have
+  //before it is subdivided.
+  static constexpr int fieldTileSize = 16;
+  static constexpr size_t fieldCandidateLimit = 64;
+
+  //################################################################################################
+  struct FieldGrid
+  {
+    double minX{0.0};
+    double minY{0.0};
+    double stepX{0.0};
+    double stepY{0.0};
+    int width{0};
+    float* out{nullptr};
+  };
+
+  //################################################################################################
+  struct FieldCandidate
+  {
+    double x;
+    double y;
+    double dist; //!< The distance from the centre of the tile.
+  };
+
+  //################################################################################################
+  struct FieldScratch
+  {
+    std::vector<const Coord*> coords;
+    std::vector<FieldCandidate> candidates;
+  };
+
+  //################################################################################################
+  void distanceFieldTile(const FieldGrid& grid, int px, int py, int pw, int ph, FieldScratch& scratch) const
+  {
+    //The centre of the pixel centres in the tile, and the distance from it to the furthest one.
+    double x = grid.minX + (px + pw*0.5)*grid.stepX;
+    double y = grid.minY + (py + ph*0.5)*grid.stepY;
+    double halfW = (pw-1)*0.5*grid.stepX;
+    double halfH = (ph-1)*0.5*grid.stepY;
+    double halfDiag = std::sqrt((halfW*halfW) + (halfH*halfH));
+
+    int distSQ = std::numeric_limits<int>::max();
+    const Coord* closest=nullptr;
+    m_root->closestPoint(int(std::lround(x)), int(std::lround(y)), distSQ, closest, AcceptAll(), ~uint64_t(0));
+
+    if(!closest)
+    {
+      for(int j=py; j<py+ph; j++)
+        for(int i=px; i<px+pw; i++)
+          grid.out[size_t(j)*size_t(grid.width) + size_t(i)] = std::numeric_limits<float>::infinity();
+      return;
+    }
+
+    //Every pixel is within dc+halfDiag of the closest coord, so its own closest coord must be
+    //within dc+2*halfDiag of the centre.
+    double dcx = closest->x-x;
+    double dcy = closest->y-y;
+    double radius = std::sqrt((dcx*dcx) + (dcy*dcy)) + 2.0*halfDiag;
+    double radiusSQ = radius*radius*(1.0+1e-9) + 1e-9;
+
+    const double inf = std::numeric_limits<double>::infinity();
+    bool split = pw>1 || ph>1;
+    scratch.coords.clear();
+    if(!m_root->coordsInRadius(x, y, radiusSQ, -inf, inf, -inf, inf,
+                               split?fieldCandidateLimit:std::numeric_limits<size_t>::max(),
+                               scratch.coords))
+    {
+      int w0 = (pw+1)/2;
+      int h0 = (ph+1)/2;
+      distanceFieldTile(grid, px, py, w0, h0, scratch);
+      if(pw>w0)
+        distanceFieldTile(grid, px+w0, py, pw-w0, h0, scratch);
+      if(ph>h0)
+        distanceFieldTile(grid, px, py+h0, w0, ph-h0, scratch);
+      if(pw>w0 && ph>h0)
+        distanceFieldTile(grid, px+w0, py+h0, pw-w0, ph-h0, scratch);
+      return;
+    }
+
+    //Sort the candidates by their distance from the centre of the tile, a pixel can stop testing
+    //them once they are further from the centre than its best distance plus its own distance from
+    //the centre.
+    std::vector<FieldCandidate>& candidates = scratch.candidates;
+    candidates.clear();
+    for(const Coord* c : scratch.coords)
+    {
+      double dx = c->x-x;
+      double dy = c->y-y;
+      candidates.push_back({double(c->x), double(c->y), std::sqrt((dx*dx) + (dy*dy))});
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const FieldCandidate& a, const FieldCandidate& b){return a.dist<b.dist;});
+
+    for(int j=py; j<py+ph; j++)
+    {
+      double sy = grid.minY + (j+0.5)*grid.stepY;
+      float* row = grid.out + size_t(j)*size_t(grid.width);
+      for(int i=px; i<px+pw; i++)
+      {
+        double sx = grid.minX + (i+0.5)*grid.stepX;
+        double ox = sx-x;
+        double oy = sy-y;
+        double offset = std::sqrt((ox*ox) + (oy*oy));
+
+        double best = inf;
+        double bestDist = inf;
+        for(const FieldCandidate& c : candidates)
+        {
+          if(c.dist-offset > bestDist)
+            break;
+
+          double dx = c.x-sx;
+          double dy = c.y-sy;
+          double d = (dx*dx) + (dy*dy);
+          if(d<best)
+          {
+            best = d;
+            bestDist = std::sqrt(d)*(1.0+1e-12);
+          }
+        }
+        row[i] = float(std::sqrt(best));
+      }
+    }
+  }
+
+  //################################################################################################
+  Coord closestPointToSegments(const Segment* segments, size_t count, double& distSQ) const
+  {
+    TP_QUAD_TREE_TRACE_SCOPE(Query);
+
+    std::vector<uint32_t> active;
+    active.reserve(count*8);
+    for(size_t i=0; i<count; i++)
+      active.push_back(uint32_t(i));
+
+    const double inf = std::numeric_limits<double>::infinity();
+    const Coord* closestPoint=nullptr;
+    m_root->closestPointToSegments(segments, active, 0, count, -inf, inf, -inf, inf, distSQ, closestPoint);
+    return (closestPoint)?*closestPoint:Coord();
+  }
+
+  std::shared_ptr<Cell> m_root;
+  std::shared_ptr<Cell[]> m_pool; //!< Holds the cells allocated by compact().
   int m_count{0};
+  uint64_t m_version{0}; //!< Incremented each time the cells change, used to invalidate cursors.
+  mutable std::atomic<uint64_t> m_generation{0}; //!< Incremented by snapshot(), see Cell::generation.
+  int m_minX; //!< The lower bounds of the root, see compact().
+  int m_minY;
+  SplitConfig m_splitConfig;
+  std::unique_ptr<QueryCache<Coord, Metric>> m_queryCache;
 };
 
 }
@@ -0,0 +1,242 @@
+#ifndef tp_quad_tree_QuadTreePolicies_h
+#define tp_quad_tree_QuadTreePolicies_h
+
+#include "tp_quad_tree/Globals.h" // IWYU pragma: keep
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+namespace tp_quad_tree
+{
+
+//##################################################################################################
+//! The default category policy, cells do not store category masks
+/*!
+A category policy maps a value to a set of category flags, each cell stores the OR of the flags of
+every coord below it so that searches for a category can skip whole subtrees. To enable this pass a
+policy like the following to QuadTreeIntTemplate:
+
+\code
+struct MyCategories
+{
+  static constexpr bool enabled=true;
+  static uint64_t mask(const MyValue& value){return uint64_t(1)<<value.category;}
+};
+\endcode
+*/
+struct NoCategories
+{
+  static constexpr bool enabled=false;
+
+  //################################################################################################
+  template<typename T>
+  static uint64_t mask(const T&)
+  {
+    return ~uint64_t(0);
+  }
+};
+
+//##################################################################################################
+//! The default aggregate policy, cells only store a count of the coords below them
+/*!
+An aggregate policy describes a monoid over the values stored in the tree, each cell stores the
+combination of every value below it so that aggregateInRect() can use whole cells without visiting
+the coords inside them. combine() must be associative and identity() must be its identity element.
+
+\code
+struct SumAggregate
+{
+  static constexpr bool enabled=true;
+  using Value=double;
+  static Value identity(){return 0.0;}
+  static Value lift(const MyValue& value){return value.weight;}
+  static Value combine(const Value& a, const Value& b){return a+b;}
+};
+\endcode
+*/
+struct NoAggregate
+{
+  static constexpr bool enabled=false;
+};
+
+//##################################################################################################
+//! How a leaf chooses the point to split at once it is full
+enum class SplitPolicy
+{
+  Centre,    //!< Split at the centre of the cell, the default.
+  Median,    //!< Split at the median x and y of the coords in the leaf.
+  Compressed //!< Split at the centre of the bounding box of the coords, skipping empty levels.
+};
+
+//##################################################################################################
+//! The default metric policy, squared Euclidean distance
+/*!
+A metric policy supplies the distance between two points and lower bounds on the distance to any
+point in a cell, the bounds are used to prune cells in the same way for every metric.
+
+\code
+struct MyMetric
+{
+  //! The distance between points separated by dx and dy, must increase with |dx| and |dy|.
+  static int distance(int dx, int dy);
+
+  //! A lower bound on the distance to any point separated by at least |d| on the x or y axis.
+  static int boundX(int d);
+  static int boundY(int d);
+
+  //! A lower bound on the distance to any point separated on both axes given the axis bounds.
+  static int combine(int boundX, int boundY);
+
+  //! The largest separation on the x or y axis at which a point can be closer than distance.
+  static int radiusX(int distance);
+  static int radiusY(int distance);
+};
+\endcode
+
+Distances are still returned through the distSQ arguments, for other metrics these hold the
+distance in the units of the metric.
+*/
+struct EuclideanMetric
+{
+  static int distance(int dx, int dy){return (dx*dx) + (dy*dy);}
+  static int boundX(int d){return d*d;}
+  static int boundY(int d){return d*d;}
+  static int combine(int boundX, int boundY){return boundX + boundY;}
+  static int radiusX(int distance){return int(std::ceil(std::sqrt(double(distance))));}
+  static int radiusY(int distance){return int(std::ceil(std::sqrt(double(distance))));}
+};
+
+//##################################################################################################
+//! Squared Euclidean distance with the squared x and y differences scaled by integer weights
+template<int WeightX, int WeightY>
+struct ScaledEuclideanMetric
+{
+  static_assert(WeightX>0 && WeightY>0, "Weights must be greater than 0");
+  static int distance(int dx, int dy){return (WeightX*dx*dx) + (WeightY*dy*dy);}
+  static int boundX(int d){return WeightX*d*d;}
+  static int boundY(int d){return WeightY*d*d;}
+  static int combine(int boundX, int boundY){return boundX + boundY;}
+  static int radiusX(int distance){return int(std::ceil(std::sqrt(double(distance)/WeightX)));}
+  static int radiusY(int distance){return int(std::ceil(std::sqrt(double(distance)/WeightY)));}
+};
+
+//##################################################################################################
+//! L1 distance, |dx|+|dy|
+struct ManhattanMetric
+{
+  static int distance(int dx, int dy){return std::abs(dx) + std::abs(dy);}
+  static int boundX(int d){return std::abs(d);}
+  static int boundY(int d){return std::abs(d);}
+  static int combine(int boundX, int boundY){return boundX + boundY;}
+  static int radiusX(int distance){return distance;}
+  static int radiusY(int distance){return distance;}
+};
+
+//##################################################################################################
+//! L-infinity distance, max(|dx|, |dy|)
+struct ChebyshevMetric
+{
+  static int distance(int dx, int dy){return std::max(std::abs(dx), std::abs(dy));}
+  static int boundX(int d){return std::abs(d);}
+  static int boundY(int d){return std::abs(d);}
+  static int combine(int boundX, int boundY){return std::max(boundX, boundY);}
+  static int radiusX(int distance){return distance;}
+  static int radiusY(int distance){return distance;}
+};
+
+//##################################################################################################
+//! A predicate that accepts every coord
+struct AcceptAll
+{
+  //################################################################################################
+  template<typename Coord>
+  bool operator()(const Coord&) const
+  {
+    return true;
+  }
+};
+
+namespace detail
+{
+
+//##################################################################################################
+template<bool enabled>
+struct CategoryStorage
+{
+  uint64_t categoryMask{0};
+};
+
+//##################################################################################################
+template<>
+struct CategoryStorage<false>
+{
+
+};
+
+//##################################################################################################
+template<typename Aggregate, bool enabled=Aggregate::enabled>
+struct AggregateStorage
+{
+  typename Aggregate::Value aggregate{Aggregate::identity()};
+};
+
+//##################################################################################################
+template<typename Aggregate>
+struct AggregateStorage<Aggregate, false>
+{
+
+};
+
+//##################################################################################################
+//! Insert a result into a list of the k closest coords sorted by distance
+/*!
+Once the list holds k results distSQ is reduced to the distance of the furthest of them, so the rest
+of the search only looks for closer coords.
+*/
+template<typename CoordDistance, typename Distance>
+void insertClosest(const CoordDistance& result, int k, Distance& distSQ, std::vector<CoordDistance>& results)
+{
+  size_t i=results.size();
+  for(; i>0 && result.distSQ<results[i-1].distSQ; i--){}
+  results.insert(results.begin()+std::ptrdiff_t(i), result);
+
+  if(int(results.size())>k)
+    results.pop_back();
+
+  if(int(results.size())==k)
+    distSQ = results.back().distSQ;
+}
+
+//##################################################################################################
+//! Visit the children of a cell in the order used by QuadTreeIntTemplate::Cell::closestPoint()
+/*!
+\param q - The index of the child containing the point.
+\param dx - The squared distance from the point to the x split.
+\param dy - The squared distance from the point to the y split.
+\param distSQ - The current search radius, this is read again before each child.
+\param visit - Called with the index of each child that is within the search radius.
+*/
+template<typename Distance, typename Visit>
+void visitClosestChildFirst(int q, Distance dx, Distance dy, const Distance& distSQ, const Visit& visit)
+{
+  visit(q);
+
+  if(dx<distSQ)
+    visit(q^1);
+
+  if(dy<distSQ)
+    visit(q^2);
+
+  if((dx+dy)<distSQ)
+    visit(q^3);
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef tp_quad_tree_QueryCache_h
+#define tp_quad_tree_QueryCache_h
+
+#include "tp_quad_tree/Globals.h" // IWYU pragma: keep
+#include "tp_quad_tree/QuadTreePolicies.h"
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+namespace tp_quad_tree
+{
+
+//##################################################################################################
+//! Counters describing the effectiveness of a QueryCache
+struct QueryCacheStats
+{
+  size_t hits{0};
+  size_t misses{0};
+  size_t invalidations{0};
+};
+
+//##################################################################################################
+//! A direct mapped cache of closest point results keyed by quantized query location
+/*!
+Each entry stores the query that populated it, the coord that was found, and the distance to that
+coord. An entry remains valid until a coord is added that is closer to its query than the cached
+result, so addCoord() only invalidates the entries whose result it could actually change.
+
+With a quantum of 1 cached results are exact. With a larger quantum queries anywhere in the same
+quantum share an entry, the result is the closest coord to the query that populated the entry so it
+is approximate, it may not be the closest coord to the query that finds it. The distance returned is
+always the distance from the query that finds it. If that is outside the caller's search radius
+QuadTreeIntTemplate::closestPoint() falls back to a full search rather than reporting no coord.
+
+\tparam Coord - The coord type of the tree, must have int x and y members.
+\tparam Metric - The metric used by the tree, see EuclideanMetric.
+*/
+template<typename Coord, typename Metric=EuclideanMetric>
+class QueryCache
+{
+public:
+  //################################################################################################
+  /*!
+  \param quantum - The size of the square that query locations are quantized to.
+  \param capacity - The number of entries, rounded up to a power of two.
+  */
+  QueryCache(int quantum, size_t capacity):
+    m_quantum(quantum>0?quantum:1)
+  {
+    size_t size=1;
+    while(size<capacity)
+      size<<=1;
+    m_entries.resize(size);
+    m_mask = size-1;
+  }
+
+  //################################################################################################
+  //! Look up a query, returns the cached coord or nullptr on a miss
+  /*!
+  \param x - The x coord of the query.
+  \param y - The y coord of the query.
+  \param distSQ - The search radius, a cached coord that is not inside it counts as a miss. On a hit
+         this is updated with the distance to the cached coord.
+  */
+  const Coord* find(int x, int y, int& distSQ)
+  {
+    int kx = quantize(x);
+    int ky = quantize(y);
+    const Entry& entry = m_entries[slot(kx, ky)];
+    if(!entry.valid || entry.kx!=kx || entry.ky!=ky)
+    {
+      m_stats.misses++;
+      return nullptr;
+    }
+
+    int cachedDistSQ = Metric::distance(entry.coord.x-x, entry.coord.y-y);
+    if(cachedDistSQ>=distSQ)
+    {
+      m_stats.misses++;
+      return nullptr;
+    }
+
+    m_stats.hits++;
+    distSQ = cachedDistSQ;
+    return &entry.coord;
+  }
+
+  //################################################################################################
+  //! Store the result of a query
+  void insert(int x, int y, const Coord& coord, int distSQ)
+  {
+    int kx = quantize(x);
+    int ky = quantize(y);
+    Entry& entry = m_entries[slot(kx, ky)];
+    entry.valid = true;
+    entry.kx = kx;
+    entry.ky = ky;
+    entry.x = x;
+    entry.y = y;
+    entry.distSQ = distSQ;
+    entry.coord = coord;
+
+    if(distSQ>m_maxDistSQ)
+    {
+      m_maxDistSQ = distSQ;
+      m_radiusX = Metric::radiusX(distSQ);
+      m_radiusY = Metric::radiusY(distSQ);
+    }
+  }
+
+  //################################################################################################
+  //! Invalidate the entries whose query is closer to a new coord than to their cached result
+  /*!
+  If the quanta that could hold affected entries are fewer than the number of entries only those
+  slots are probed, otherwise every entry is checked.
+  */
+  void coordAdded(int x, int y)
+  {
+    int64_t minKX = quantize(clamp(int64_t(x)-m_radiusX));
+    int64_t maxKX = quantize(clamp(int64_t(x)+m_radiusX));
+    int64_t minKY = quantize(clamp(int64_t(y)-m_radiusY));
+    int64_t maxKY = quantize(clamp(int64_t(y)+m_radiusY));
+
+    if((maxKX-minKX+1)*(maxKY-minKY+1) < int64_t(m_entries.size()))
+    {
+      for(int64_t ky=minKY; ky<=maxKY; ky++)
+      {
+        for(int64_t kx=minKX; kx<=maxKX; kx++)
+        {
+          Entry& entry = m_entries[slot(int(kx), int(ky))];
+          if(entry.kx==kx && entry.ky==ky)
+            invalidate(entry, x, y);
+        }
+      }
+    }
+    else
+    {
+      for(Entry& entry : m_entries)
+        invalidate(entry, x, y);
+    }
+  }
+
+  //################################################################################################
+  const QueryCacheStats& stats() const
+  {
+    return m_stats;
+  }
+
+private:
+  //################################################################################################
+  struct Entry
+  {
+    bool valid{false};
+    int kx{0};
+    int ky{0};
+    int x{0};
+    int y{0};
+    int distSQ{0};
+    Coord coord;
+  };
+
+  //################################################################################################
+  void invalidate(Entry& entry, int x, int y)
+  {
+    if(!entry.valid)
+      return;
+
+    if(Metric::distance(entry.x-x, entry.y-y) < entry.distSQ)
+    {
+      entry.valid = false;
+      m_stats.invalidations++;
+    }
+  }
+
+  //################################################################################################
+  int quantize(int v) const
+  {
+    return (v>=0)?(v/m_quantum):(-((-(v+1))/m_quantum)-1);
+  }
+
+  //################################################################################################
+  static int clamp(int64_t v)
+  {
+    return int(std::max(int64_t(std::numeric_limits<int>::min()), std::min(int64_t(std::numeric_limits<int>::max()), v)));
+  }
+
+  //################################################################################################
+  size_t slot(int kx, int ky) const
+  {
+    return (size_t(uint32_t(kx)*73856093u) ^ size_t(uint32_t(ky)*19349663u)) & m_mask;
+  }
+
+  int m_quantum;
+  size_t m_mask{0};
+  int m_maxDistSQ{0};
+  int64_t m_radiusX{0};
+  int64_t m_radiusY{0};
+  std::vector<Entry> m_entries;
+  QueryCacheStats m_stats;
+};
+
+}
+
+#endif
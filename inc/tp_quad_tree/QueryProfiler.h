@@ -0,0 +1,224 @@
+#ifndef tp_quad_tree_QueryProfiler_h
+#define tp_quad_tree_QueryProfiler_h
+
+#include "tp_quad_tree/FrozenQuadTreeIntTemplate.h"
+#include "tp_quad_tree/Trace.h"
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace tp_quad_tree
+{
+
+//##################################################################################################
+//! A single recorded query, k==1 for closestPoint()
+struct QueryRecord
+{
+  int x{0};
+  int y{0};
+  int k{1};
+};
+
+//##################################################################################################
+//! Latency distribution of a replayed query log, times are in nanoseconds
+struct LatencyReport
+{
+  size_t queries{0};
+  double mean{0.0};
+  double p50{0.0};
+  double p99{0.0};
+  double p999{0.0};
+  double max{0.0};
+
+  //! The trace counters accumulated during the replay, only populated if TP_QUAD_TREE_TRACE is
+  //! defined.
+  TraceCounters trace;
+};
+
+//##################################################################################################
+//! Replays recorded queries against a tree and reports tail latency
+/*!
+Query logs are text files with one query per line in the form "x y" or "x y k". Each query is timed
+individually so that the percentiles reflect the tail and not just the average, this adds the
+overhead of reading a steady clock twice per query.
+
+A profiling driver only needs to load a log and call one of the replay functions, for example:
+\code
+std::vector<tp_quad_tree::QueryRecord> queries;
+tp_quad_tree::QueryProfiler::loadQueryLog(argv[2], queries);
+tp_quad_tree::LatencyReport report;
+tp_quad_tree::QueryProfiler::replayFrozen<int>(argv[1], queries, report);
+std::cout << tp_quad_tree::QueryProfiler::format(report);
+\endcode
+
+The library does not build any executables so no driver target is provided, the example above is
+the complete driver for a frozen tree.
+*/
+class QueryProfiler
+{
+public:
+  //################################################################################################
+  static bool loadQueryLog(const std::string& path, std::vector<QueryRecord>& queries)
+  {
+    std::ifstream in(path);
+    if(!in)
+      return false;
+
+    std::string line;
+    while(std::getline(in, line))
+    {
+      std::istringstream ss(line);
+      QueryRecord query;
+      if(!(ss >> query.x >> query.y))
+        continue;
+      if(!(ss >> query.k))
+        query.k = 1;
+      queries.push_back(query);
+    }
+    return true;
+  }
+
+  //################################################################################################
+  static bool saveQueryLog(const std::string& path, const std::vector<QueryRecord>& queries)
+  {
+    std::ofstream out(path);
+    for(const QueryRecord& query : queries)
+      out << query.x << ' ' << query.y << ' ' << query.k << '\n';
+    return out.good();
+  }
+
+  //################################################################################################
+  //! Time each query individually
+  /*!
+  \param queries - The queries to replay.
+  \param query - Called with each QueryRecord, this should run the query against the tree.
+  \param warmup - The number of queries to run before timing starts, to warm the caches.
+  \return The latency distribution.
+  */
+  template<typename Query>
+  static LatencyReport replay(const std::vector<QueryRecord>& queries, const Query& query, size_t warmup=0)
+  {
+    for(size_t i=0; i<warmup && !queries.empty(); i++)
+      query(queries[i%queries.size()]);
+
+    traceCounters().reset();
+
+    std::vector<uint64_t> times;
+    times.reserve(queries.size());
+    for(const QueryRecord& record : queries)
+    {
+      auto start = std::chrono::steady_clock::now();
+      query(record);
+      auto end = std::chrono::steady_clock::now();
+      times.push_back(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end-start).count()));
+    }
+
+    LatencyReport report = summarize(times);
+    report.trace = traceCounters();
+    return report;
+  }
+
+  //################################################################################################
+  //! Replay closestPoint() queries against a tree saved with FrozenQuadTreeIntTemplate::save()
+  /*!
+  The k of each query is ignored as the frozen tree only supports closestPoint().
+  */
+  template<typename T>
+  static bool replayFrozen(const std::string& treePath, const std::vector<QueryRecord>& queries, LatencyReport& report, size_t warmup=0)
+  {
+    std::ifstream in(treePath, std::ios::binary | std::ios::ate);
+    if(!in)
+      return false;
+
+    size_t size = size_t(in.tellg());
+    in.seekg(0);
+
+    //view() requires 16 byte alignment.
+    struct alignas(16) Block
+    {
+      unsigned char bytes[16];
+    };
+    std::vector<Block> buffer((size+15)/16);
+    if(!in.read(reinterpret_cast<char*>(buffer.data()), std::streamsize(size)))
+      return false;
+
+    auto tree = FrozenQuadTreeIntTemplate<T>::view(buffer.data(), size);
+    if(!tree)
+      return false;
+
+    report = replay(queries, [&](const QueryRecord& query)
+    {
+      int distSQ = std::numeric_limits<int>::max();
+      tree->closestPoint(query.x, query.y, distSQ);
+    }, warmup);
+    return true;
+  }
+
+  //################################################################################################
+  //! Calculate the latency distribution of a set of times in nanoseconds
+  static LatencyReport summarize(std::vector<uint64_t> times)
+  {
+    LatencyReport report;
+    report.queries = times.size();
+    if(times.empty())
+      return report;
+
+    std::sort(times.begin(), times.end());
+
+    double total=0.0;
+    for(uint64_t t : times)
+      total += double(t);
+
+    report.mean = total / double(times.size());
+    report.p50  = percentile(times, 0.5);
+    report.p99  = percentile(times, 0.99);
+    report.p999 = percentile(times, 0.999);
+    report.max  = double(times.back());
+    return report;
+  }
+
+  //################################################################################################
+  //! Nearest rank percentile of sorted times, p is in the range 0 to 1
+  static double percentile(const std::vector<uint64_t>& sorted, double p)
+  {
+    if(sorted.empty())
+      return 0.0;
+
+    size_t rank = size_t(std::ceil(p*double(sorted.size())));
+    return double(sorted[std::min(sorted.size(), std::max(size_t(1), rank))-1]);
+  }
+
+  //################################################################################################
+  static std::string format(const LatencyReport& report)
+  {
+    std::ostringstream ss;
+    ss << "queries: " << report.queries << '\n'
+       << "mean:    " << report.mean << " ns\n"
+       << "p50:     " << report.p50  << " ns\n"
+       << "p99:     " << report.p99  << " ns\n"
+       << "p999:    " << report.p999 << " ns\n"
+       << "max:     " << report.max  << " ns\n";
+
+    const TraceCounters& trace = report.trace;
+    if(trace.calls[int(TracePhase::Query)])
+    {
+      ss << "descent cycles:       " << trace.descentCycles() << '\n'
+         << "leaf scan cycles:     " << trace.leafScanCycles() << '\n'
+         << "leaf scans:           " << trace.calls[int(TracePhase::LeafScan)] << '\n'
+         << "result updates:       " << trace.calls[int(TracePhase::ResultUpdate)] << '\n';
+    }
+
+    return ss.str();
+  }
+};
+
+}
+
+#endif
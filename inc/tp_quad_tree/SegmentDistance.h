@@ -0,0 +1,112 @@
+#ifndef tp_quad_tree_SegmentDistance_h
+#define tp_quad_tree_SegmentDistance_h
+
+#include "tp_quad_tree/Globals.h" // IWYU pragma: keep
+
+#include <cmath>
+#include <algorithm>
+
+namespace tp_quad_tree
+{
+
+//##################################################################################################
+//! A line segment from (x0, y0) to (x1, y1), used by the segment and polyline searches
+struct Segment
+{
+  double x0{0.0};
+  double y0{0.0};
+  double x1{0.0};
+  double y1{0.0};
+
+  //################################################################################################
+  Segment(double x0_=0.0, double y0_=0.0, double x1_=0.0, double y1_=0.0):
+    x0(x0_),
+    y0(y0_),
+    x1(x1_),
+    y1(y1_)
+  {
+
+  }
+};
+
+namespace detail
+{
+
+//##################################################################################################
+//! Squared distance from a point to a segment
+inline double pointSegmentDistSQ(double x, double y, const Segment& s)
+{
+  double dx = s.x1-s.x0;
+  double dy = s.y1-s.y0;
+  double lenSQ = (dx*dx) + (dy*dy);
+
+  double t = (lenSQ>0.0)?std::clamp(((x-s.x0)*dx + (y-s.y0)*dy)/lenSQ, 0.0, 1.0):0.0;
+  double px = s.x0 + t*dx - x;
+  double py = s.y0 + t*dy - y;
+  return (px*px) + (py*py);
+}
+
+//##################################################################################################
+//! Squared distance from a point to a box, the bounds may be infinite
+inline double pointBoxDistSQ(double x, double y, double loX, double hiX, double loY, double hiY)
+{
+  double dx = (x<loX)?(loX-x):((x>hiX)?(x-hiX):0.0);
+  double dy = (y<loY)?(loY-y):((y>hiY)?(y-hiY):0.0);
+  return (dx*dx) + (dy*dy);
+}
+
+//##################################################################################################
+//! Returns true if a segment intersects or touches a box, the bounds may be infinite
+inline bool segmentIntersectsBox(const Segment& s, double loX, double hiX, double loY, double hiY)
+{
+  //Clip the segment against each slab in turn, keeping the parameter range inside the box.
+  double t0=0.0;
+  double t1=1.0;
+
+  auto clip = [&](double p, double d, double lo, double hi)
+  {
+    if(d==0.0)
+      return p>=lo && p<=hi;
+
+    double a = (lo-p)/d;
+    double b = (hi-p)/d;
+    if(a>b)
+      std::swap(a, b);
+
+    t0 = std::max(t0, a);
+    t1 = std::min(t1, b);
+    return t0<=t1;
+  };
+
+  return clip(s.x0, s.x1-s.x0, loX, hiX) && clip(s.y0, s.y1-s.y0, loY, hiY);
+}
+
+//##################################################################################################
+//! Squared distance from a segment to a box, the bounds may be infinite
+/*!
+If they do not intersect the closest pair of points includes an end of the segment or a corner of
+the box, corners at infinity can never be the closest and are skipped.
+*/
+inline double segmentBoxDistSQ(const Segment& s, double loX, double hiX, double loY, double hiY)
+{
+  if(segmentIntersectsBox(s, loX, hiX, loY, hiY))
+    return 0.0;
+
+  double distSQ = std::min(pointBoxDistSQ(s.x0, s.y0, loX, hiX, loY, hiY),
+                           pointBoxDistSQ(s.x1, s.y1, loX, hiX, loY, hiY));
+
+  const double xs[2] = {loX, hiX};
+  const double ys[2] = {loY, hiY};
+  for(double x : xs)
+    for(double y : ys)
+      if(std::isfinite(x) && std::isfinite(y))
+        distSQ = std::min(distSQ, pointSegmentDistSQ(x, y, s));
+
+  return distSQ;
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,411 @@
+#ifndef tp_quad_tree_SpatialTreeTemplate_h
+#define tp_quad_tree_SpatialTreeTemplate_h
+
+#include "tp_quad_tree/Globals.h" // IWYU pragma: keep
+#include "tp_quad_tree/QuadTreePolicies.h"
+
+#include "tp_utils/Globals.h"
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+
+namespace tp_quad_tree
+{
+
+//##################################################################################################
+//! A 2^Dims-ary tree for coords with 3 or more dimensions, see OctreeIntTemplate
+/*!
+Each cell is split at its centre into 2^Dims children. Bit i of a child's index is set if the child
+is on the high side of the split on axis i, so the first four children of an octree are in the
+usual quad tree order and the z1 children follow them:
+
+  0=x0 y0 z0
+  1=x1 y0 z0
+  2=x0 y1 z0
+  3=x1 y1 z0
+  4..7 as above with z1
+
+Nearest neighbour searches visit the child containing the point first, then the neighbour across
+each combination of split planes, pruning each against the sum of the squared distances to the
+planes that separate it from the point. Dims is a compile time constant so the loops over axes and
+children are fully unrolled for each dimension.
+
+For int coords cells stop splitting when their radius reaches 1 on any axis, in the same way as
+QuadTreeIntTemplate. For floating point coords they stop splitting when the split point can no
+longer be distinguished from the centres of the children.
+
+This is a separate tree with its own cells, it does not share code with QuadTreeIntTemplate or
+QuadTreeFloat. It provides nearest, k nearest, box, and bulk build, but none of the features of the
+2D trees such as categories, aggregates, metrics, snapshots, or periodic bounds, for 2D data use
+those instead.
+
+\tparam Scalar - The coord type, int, float, or double.
+\tparam Dims - The number of dimensions, 3 for an octree.
+\tparam T - The type of value stored with each coord.
+*/
+template<typename Scalar, int Dims, typename T>
+class SpatialTreeTemplate
+{
+  static_assert(Dims>0 && Dims<=8, "SpatialTreeTemplate supports 1 to 8 dimensions");
+public:
+  static constexpr int childCount = 1<<Dims;
+
+  //! The type used for squared distances, int for int coords as in QuadTreeIntTemplate
+  using Distance = typename std::conditional<std::is_integral<Scalar>::value, int, Scalar>::type;
+
+  using Point = std::array<Scalar, Dims>;
+
+  //################################################################################################
+  struct Coord
+  {
+    Point position;
+
+    T value;
+
+    //##############################################################################################
+    Coord(const Point& position_=Point(), const T& value_=T()):
+      position(position_),
+      value(value_)
+    {
+
+    }
+  };
+
+  //################################################################################################
+  struct CoordDistance
+  {
+    const Coord* coord;
+    Distance distSQ;
+
+    CoordDistance(const Coord* coord_=nullptr, Distance distSQ_=0):
+      coord(coord_),
+      distSQ(distSQ_)
+    {
+
+    }
+  };
+
+  //################################################################################################
+  //! Construct an empty tree
+  /*!
+  \param min - The minimum corner of the tree.
+  \param max - The maximum corner of the tree.
+  \param cellSize - The maximum number of coords in a cell
+  */
+  SpatialTreeTemplate(const Point& min, const Point& max, int cellSize):
+    m_root(new Cell(cellSize))
+  {
+    for(int i=0; i<Dims; i++)
+    {
+      m_root->rad[size_t(i)] = (max[size_t(i)]-min[size_t(i)])/2;
+      m_root->centre[size_t(i)] = min[size_t(i)]+m_root->rad[size_t(i)];
+    }
+  }
+
+  //################################################################################################
+  //! Construct a tree from a set of coords
+  /*!
+  This builds the tree top down by partitioning the coords in place, it produces the same cells as
+  adding the coords one at a time but is considerably faster.
+
+  \param min - The minimum corner of the tree.
+  \param max - The maximum corner of the tree.
+  \param cellSize - The maximum number of coords in a cell
+  \param coords - The coords to add to the tree.
+  */
+  SpatialTreeTemplate(const Point& min, const Point& max, int cellSize, std::vector<Coord>&& coords):
+    SpatialTreeTemplate(min, max, cellSize)
+  {
+    m_root->build(coords.data(), coords.data()+coords.size());
+    m_count = int(coords.size());
+  }
+
+  //################################################################################################
+  //! Add a coordinate to the tree
+  /*!
+  This will add a coordinate to the tree, this will divide cells as required.
+
+  \param coord - The coordinate to add.
+  */
+  void addCoord(const Coord& coord)
+  {
+    m_root->addCoord(coord);
+    m_count++;
+  }
+
+  //################################################################################################
+  //! Find the closes coord to the point
+  /*!
+  \param point - The point to search from.
+  \param distSQ - This will be updated with the distance to the closest coord the initial value \
+         will limit the search radius.
+  \return The coord if one is found, else a null Coord.
+  */
+  Coord closestPoint(const Point& point, Distance& distSQ) const
+  {
+    const Coord* closestPoint=nullptr;
+    m_root->visit(point, distSQ, [&](const Coord* c, Distance nDist)
+    {
+      closestPoint = c;
+      distSQ = nDist;
+    });
+    return (closestPoint)?*closestPoint:Coord();
+  }
+
+  //################################################################################################
+  //! Find the k closest coords to the point
+  /*!
+  \param point - The point to search from.
+  \param k - The maximum number of coords to return.
+  \param distSQ - Limits the search radius, once k coords have been found this is updated with the \
+         distance to the furthest of them.
+  \param results - Populated with the closest coords sorted by distance.
+  */
+  void kClosestPoints(const Point& point, int k, Distance& distSQ, std::vector<CoordDistance>& results) const
+  {
+    m_root->visit(point, distSQ, [&](const Coord* c, Distance nDist)
+    {
+      detail::insertClosest(CoordDistance(c, nDist), k, distSQ, results);
+    });
+  }
+
+  //################################################################################################
+  //! Find all the coords inside a box
+  /*!
+  \param min - The minimum corner of the box, inclusive.
+  \param max - The maximum corner of the box, inclusive.
+  \param results - The coords inside the box are appended to this.
+  */
+  void coordsInBox(const Point& min, const Point& max, std::vector<Coord>& results) const
+  {
+    m_root->coordsInBox(min, max, results);
+  }
+
+  //################################################################################################
+  int size() const
+  {
+    return m_count;
+  }
+
+private:
+  SpatialTreeTemplate(const SpatialTreeTemplate&)=delete;
+  SpatialTreeTemplate& operator=(const SpatialTreeTemplate&)=delete;
+
+  //################################################################################################
+  struct Cell
+  {
+    TP_NONCOPYABLE(Cell);
+    std::vector<Coord> coords;
+
+    //Bit i of the index is set for children on the high side of axis i.
+    std::unique_ptr<Cell[]> children;
+
+    //The centre of the cell, for internal cells this is the split point.
+    Point centre{};
+    Point rad{};
+    int cellSize;
+
+    //##############################################################################################
+    Cell(int cellSize_=20):
+      cellSize(cellSize_)
+    {
+
+    }
+
+    //##############################################################################################
+    int findChild(const Point& p) const
+    {
+      int q=0;
+      for(int i=0; i<Dims; i++)
+        if(!(p[size_t(i)]<centre[size_t(i)]))
+          q |= 1<<i;
+      return q;
+    }
+
+    //##############################################################################################
+    //! Returns true if the cell can be split, and the radius of its children
+    bool childRadius(Point& nRad) const
+    {
+      for(int i=0; i<Dims; i++)
+      {
+        Scalar r = rad[size_t(i)]/2;
+        nRad[size_t(i)] = r;
+
+        if constexpr(std::is_integral<Scalar>::value)
+        {
+          if(r<=1)
+            return false;
+        }
+        else
+        {
+          if(!(centre[size_t(i)]-r<centre[size_t(i)]) || !(centre[size_t(i)]+r>centre[size_t(i)]))
+            return false;
+        }
+      }
+      return true;
+    }
+
+    //##############################################################################################
+    //! Create the children, returns false if the cell is already at the minimum size
+    bool createChildren()
+    {
+      Point nRad;
+      if(!childRadius(nRad))
+        return false;
+
+      children.reset(new Cell[childCount]);
+      for(int q=0; q<childCount; q++)
+      {
+        Cell& child = children[q];
+        child.cellSize = cellSize;
+        child.rad = nRad;
+        for(int i=0; i<Dims; i++)
+          child.centre[size_t(i)] = (q&(1<<i))?(centre[size_t(i)]+nRad[size_t(i)]):(centre[size_t(i)]-nRad[size_t(i)]);
+      }
+      return true;
+    }
+
+    //##############################################################################################
+    void addCoord(const Coord& coord)
+    {
+      if(!children)
+      {
+        coords.push_back(coord);
+        if(int(coords.size())>cellSize && createChildren())
+        {
+          for(const Coord& c : coords)
+            children[findChild(c.position)].addCoord(c);
+
+          coords.clear();
+          coords.shrink_to_fit();
+        }
+      }
+      else
+        children[findChild(coord.position)].addCoord(coord);
+    }
+
+    //##############################################################################################
+    void build(Coord* begin, Coord* end)
+    {
+      if((end-begin)>cellSize && createChildren())
+        buildChildren(begin, end, Dims-1, 0);
+      else
+        coords.assign(begin, end);
+    }
+
+    //##############################################################################################
+    //! Partition the coords on each axis in turn and build the children from the partitions
+    void buildChildren(Coord* begin, Coord* end, int axis, int q)
+    {
+      if(axis<0)
+      {
+        children[q].build(begin, end);
+        return;
+      }
+
+      Scalar split = centre[size_t(axis)];
+      Coord* mid = std::partition(begin, end, [&](const Coord& coord){return coord.position[size_t(axis)]<split;});
+      buildChildren(begin, mid, axis-1, q);
+      buildChildren(mid,   end, axis-1, q | (1<<axis));
+    }
+
+    //##############################################################################################
+    template<typename Leaf>
+    void visit(const Point& p, Distance& distSQ, const Leaf& leaf) const
+    {
+      if(children)
+      {
+        Distance d[Dims];
+        for(int i=0; i<Dims; i++)
+        {
+          Distance v = Distance(centre[size_t(i)]-p[size_t(i)]);
+          d[i] = v*v;
+        }
+
+        //See the class documentation for the order the children are visited in.
+        int q = findChild(p);
+        children[q].visit(p, distSQ, leaf);
+
+        for(int m=1; m<childCount; m++)
+        {
+          Distance bound=0;
+          for(int i=0; i<Dims; i++)
+            if(m&(1<<i))
+              bound += d[i];
+
+          if(bound<distSQ)
+            children[q^m].visit(p, distSQ, leaf);
+        }
+      }
+      else
+      {
+        const Coord* c = coords.data();
+        const Coord* cMax = c + coords.size();
+        for(;c<cMax; c++)
+        {
+          Distance nDist=0;
+          for(int i=0; i<Dims; i++)
+          {
+            Distance v = Distance(c->position[size_t(i)]-p[size_t(i)]);
+            nDist += v*v;
+          }
+
+          if(nDist<distSQ)
+            leaf(c, nDist);
+        }
+      }
+    }
+
+    //##############################################################################################
+    void coordsInBox(const Point& min, const Point& max, std::vector<Coord>& results) const
+    {
+      if(children)
+      {
+        int lo=0;
+        int hi=0;
+        for(int i=0; i<Dims; i++)
+        {
+          if(min[size_t(i)]<centre[size_t(i)])
+            lo |= 1<<i;
+          if(max[size_t(i)]>=centre[size_t(i)])
+            hi |= 1<<i;
+        }
+
+        //A child is visited if the box reaches its side of the split on every axis.
+        for(int q=0; q<childCount; q++)
+          if((((~q)&lo) | (q&hi)) == childCount-1)
+            children[q].coordsInBox(min, max, results);
+      }
+      else
+      {
+        for(const Coord& coord : coords)
+        {
+          bool inside=true;
+          for(int i=0; i<Dims && inside; i++)
+            inside = coord.position[size_t(i)]>=min[size_t(i)] && coord.position[size_t(i)]<=max[size_t(i)];
+
+          if(inside)
+            results.push_back(coord);
+        }
+      }
+    }
+  };
+
+  std::unique_ptr<Cell> m_root;
+  int m_count{0};
+};
+
+//##################################################################################################
+template<typename T>
+using OctreeIntTemplate = SpatialTreeTemplate<int, 3, T>;
+
+//##################################################################################################
+template<typename T>
+using OctreeFloatTemplate = SpatialTreeTemplate<float, 3, T>;
+
+}
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef tp_quad_tree_Trace_h
+#define tp_quad_tree_Trace_h
+
+#include "tp_quad_tree/Globals.h" // IWYU pragma: keep
+
+#include <cstdint>
+#include <chrono>
+
+#if defined(TP_QUAD_TREE_TRACE) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  else
+#    include <x86intrin.h>
+#  endif
+#  define TP_QUAD_TREE_TRACE_RDTSC
+#endif
+
+//##################################################################################################
+//! Compile time tracing of the query hot paths
+/*!
+Tracing is disabled unless TP_QUAD_TREE_TRACE is defined, when it is disabled the trace macros
+expand to nothing so the traversal code is unchanged.
+
+When enabled each traced phase is timed with the cycle counter (or a steady clock on platforms
+without one) and accumulated into per thread TraceCounters. The phases are nested, a Query contains
+the descent and the leaf scans. Use descentCycles() and leafScanCycles() of TraceCounters to split
+a query into the two. Leaf scans that run outside of a Query, for example from the cursor or
+distance field searches, are counted but not subtracted from the descent.
+
+Result updates take a few cycles each and happen inside the per coord loop of a leaf scan, reading
+the timer around each one would cost more than the update itself. They are only counted, with
+TP_QUAD_TREE_TRACE_COUNT, and their time is part of the leaf scan.
+
+A TraceMarker can also be installed to be called at the start and end of each phase, this can be
+used to start and stop hardware counters or to emit markers for an external profiler.
+*/
+#ifdef TP_QUAD_TREE_TRACE
+#  define TP_QUAD_TREE_TRACE_CONCAT_(a, b) a##b
+#  define TP_QUAD_TREE_TRACE_CONCAT(a, b) TP_QUAD_TREE_TRACE_CONCAT_(a, b)
+#  define TP_QUAD_TREE_TRACE_SCOPE(phase) tp_quad_tree::TraceScope TP_QUAD_TREE_TRACE_CONCAT(tpQuadTreeTraceScope, __LINE__)(tp_quad_tree::TracePhase::phase)
+#  define TP_QUAD_TREE_TRACE_COUNT(phase) tp_quad_tree::traceCount(tp_quad_tree::TracePhase::phase)
+#else
+#  define TP_QUAD_TREE_TRACE_SCOPE(phase) do{}while(false)
+#  define TP_QUAD_TREE_TRACE_COUNT(phase) do{}while(false)
+#endif
+
+namespace tp_quad_tree
+{
+
+//##################################################################################################
+enum class TracePhase
+{
+  Query,        //!< A complete query, from the public entry point.
+  LeafScan,     //!< Calculating distances to the coords in a leaf.
+  ResultUpdate  //!< Updating the best result or inserting into the k closest results, counted only.
+};
+
+//##################################################################################################
+constexpr int tracePhaseCount = 3;
+
+//##################################################################################################
+//! The phase that a phase is nested in, or the phase itself for Query
+constexpr TracePhase traceParent(TracePhase phase)
+{
+  return (phase==TracePhase::ResultUpdate)?TracePhase::LeafScan:TracePhase::Query;
+}
+
+//##################################################################################################
+//! Accumulated inclusive cycle counts and calls for each phase on one thread
+struct TraceCounters
+{
+  uint64_t cycles[tracePhaseCount]{0, 0, 0};
+  uint64_t calls[tracePhaseCount]{0, 0, 0};
+
+  //! The cycles of each phase that ran inside its parent phase, see traceParent().
+  uint64_t nestedCycles[tracePhaseCount]{0, 0, 0};
+
+  //################################################################################################
+  void reset()
+  {
+    *this = TraceCounters();
+  }
+
+  //################################################################################################
+  //! Cycles spent descending the tree and pruning, outside of leaf scans
+  uint64_t descentCycles() const
+  {
+    return exclusive(cycles[int(TracePhase::Query)], nestedCycles[int(TracePhase::LeafScan)]);
+  }
+
+  //################################################################################################
+  //! Cycles spent scanning leaves, including the result updates that they make
+  uint64_t leafScanCycles() const
+  {
+    return cycles[int(TracePhase::LeafScan)];
+  }
+
+private:
+  //################################################################################################
+  //! Clamped at zero as cycle counters on different cores are not guaranteed to be in step
+  static uint64_t exclusive(uint64_t inclusive, uint64_t nested)
+  {
+    return (inclusive>nested)?(inclusive-nested):0;
+  }
+};
+
+//##################################################################################################
+//! Called at the start (begin=true) and end of each traced phase
+typedef void (*TraceMarker)(TracePhase phase, bool begin);
+
+//##################################################################################################
+//! The counters for the calling thread
+inline TraceCounters& traceCounters()
+{
+  thread_local TraceCounters counters;
+  return counters;
+}
+
+//##################################################################################################
+//! Counts a call to a phase without timing it or calling the marker, see TP_QUAD_TREE_TRACE_COUNT
+inline void traceCount(TracePhase phase)
+{
+  traceCounters().calls[int(phase)]++;
+}
+
+//##################################################################################################
+//! The marker for the calling thread, nullptr by default
+inline TraceMarker& traceMarker()
+{
+  thread_local TraceMarker marker=nullptr;
+  return marker;
+}
+
+//##################################################################################################
+//! The number of scopes of each phase that are open on the calling thread
+inline int* traceDepths()
+{
+  thread_local int depths[tracePhaseCount]{0, 0, 0};
+  return depths;
+}
+
+//##################################################################################################
+//! Returns the cycle counter, or nanoseconds from a steady clock if there is no cycle counter
+inline uint64_t traceTimestamp()
+{
+#ifdef TP_QUAD_TREE_TRACE_RDTSC
+  return __rdtsc();
+#else
+  return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+//##################################################################################################
+//! Times a phase for the lifetime of the scope, see TP_QUAD_TREE_TRACE_SCOPE
+class TraceScope
+{
+public:
+  //################################################################################################
+  TraceScope(TracePhase phase):
+    m_phase(phase),
+    m_nested(phase!=TracePhase::Query && traceDepths()[int(traceParent(phase))]>0)
+  {
+    traceDepths()[int(m_phase)]++;
+    if(TraceMarker marker = traceMarker(); marker)
+      marker(m_phase, true);
+    m_start = traceTimestamp();
+  }
+
+  //################################################################################################
+  ~TraceScope()
+  {
+    uint64_t end = traceTimestamp();
+    TraceCounters& counters = traceCounters();
+    counters.cycles[int(m_phase)] += end-m_start;
+    counters.calls[int(m_phase)]++;
+    if(m_nested)
+      counters.nestedCycles[int(m_phase)] += end-m_start;
+    traceDepths()[int(m_phase)]--;
+
+    if(TraceMarker marker = traceMarker(); marker)
+      marker(m_phase, false);
+  }
+
+private:
+  TraceScope(const TraceScope&)=delete;
+  TraceScope& operator=(const TraceScope&)=delete;
+
+  TracePhase m_phase;
+  bool m_nested;
+  uint64_t m_start;
+};
+
+}
+
+#endif
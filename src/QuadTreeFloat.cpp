@@ -1,18 +1,116 @@
 #include "tp_quad_tree/QuadTreeFloat.h"
+#include "tp_quad_tree/QuadTreePolicies.h"
 
 #include "tp_utils/Globals.h"
 
 #include <vector>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <utility>
 
 namespace tp_quad_tree
 {
 
+namespace
+{
+constexpr double pi = 3.14159265358979323846;
+constexpr double degToRad = pi/180.0;
+
+//! Passed to Cell::addCoord() when ids are not being tracked.
+constexpr int noId = -1;
+
+//##################################################################################################
+//! A query point for great circle searches, in radians
+struct GreatCircleQuery
+{
+  double lon;
+  double lat;
+  double cosLat;
+
+  GreatCircleQuery(float x, float y):
+    lon(double(x)*degToRad),
+    lat(double(y)*degToRad),
+    cosLat(std::cos(lat))
+  {
+
+  }
+};
+
+//##################################################################################################
+//! Wrap a longitude difference into [-pi, pi]
+double wrapLon(double dLon)
+{
+  dLon = std::fmod(dLon+pi, 2.0*pi);
+  if(dLon<0.0)
+    dLon += 2.0*pi;
+  return dLon-pi;
+}
+
+//##################################################################################################
+//! The central angle between the query and a point using the haversine formula
+double centralAngle(const GreatCircleQuery& q, double lon, double lat)
+{
+  double sLat = std::sin((lat-q.lat)*0.5);
+  double sLon = std::sin(wrapLon(lon-q.lon)*0.5);
+  double a = (sLat*sLat) + (q.cosLat*std::cos(lat)*sLon*sLon);
+  return 2.0*std::asin(std::min(1.0, std::sqrt(a)));
+}
+
+//##################################################################################################
+//! The central angle between the query and the closest point on a segment of a meridian
+double meridianAngle(const GreatCircleQuery& q, double lon, double latMin, double latMax)
+{
+  double d = std::min(centralAngle(q, lon, latMin), centralAngle(q, lon, latMax));
+
+  //If the foot of the perpendicular from the query to the meridian lies within the segment the
+  //cross track distance is closer than either end.
+  double dLon = wrapLon(q.lon-lon);
+  if(std::fabs(dLon)<(pi*0.5))
+  {
+    double footLat = std::atan(std::tan(q.lat)/std::cos(dLon));
+    if(footLat>latMin && footLat<latMax)
+      d = std::min(d, std::asin(std::min(1.0, q.cosLat*std::fabs(std::sin(dLon)))));
+  }
+
+  return d;
+}
+
+//##################################################################################################
+//! The central angle between the query and the closest point in a longitude/latitude box
+/*!
+Along a parallel the distance grows with the difference in longitude, so if the query is outside
+the longitude range of the box the closest point is on one of the two bounding meridians. Inside the
+longitude range it is directly north or south.
+*/
+double boxAngle(const GreatCircleQuery& q, float loX, float hiX, float loY, float hiY)
+{
+  double latMin = double(loY)*degToRad;
+  double latMax = double(hiY)*degToRad;
+  double lonMin = double(loX)*degToRad;
+  double lonMax = double(hiX)*degToRad;
+
+  double d;
+  if(q.lon>=lonMin && q.lon<=lonMax)
+    d = (q.lat<latMin)?(latMin-q.lat):((q.lat>latMax)?(q.lat-latMax):0.0);
+  else
+    d = std::min(meridianAngle(q, lonMin, latMin, latMax), meridianAngle(q, lonMax, latMin, latMax));
+
+  //Allow for rounding so that coords on the edge of a box are never pruned.
+  return std::max(0.0, d-1e-9);
+}
+}
+
 //##################################################################################################
 struct QuadTreeFloat::Cell
 {
   TP_NONCOPYABLE(Cell);
   std::vector<QuadTreeFloat::Coord> coords;
 
+  //The order each coord was added in, used to look up its new position in updateAll(). This is
+  //empty until updateAll() is first called, see QuadTreeFloat::m_trackIds.
+  std::vector<int> ids;
+
   //0=x0 y0
   //1=x1 y0
   //2=x0 y1
@@ -49,11 +147,14 @@ struct QuadTreeFloat::Cell
   }
 
   //################################################################################################
-  void addCoord(const QuadTreeFloat::Coord& coord)
+  //! Add a coord, id is the order it was added in or noId if ids are not being tracked
+  void addCoord(const QuadTreeFloat::Coord& coord, int id)
   {
     if(!children)
     {
       coords.push_back(coord);
+      if(id!=noId)
+        ids.push_back(id);
       if(int(coords.size())>cellSize)
       {
         float nRadX = radX/2;
@@ -89,16 +190,82 @@ struct QuadTreeFloat::Cell
         children[3].cellSize = cellSize;
         children[3].coords.reserve(cellSize);
 
-        const Coord* c = coords.data();
-        const Coord* cMax = c + coords.size();
-        for(;c<cMax; c++)
-          addCoord(*c);
+        for(size_t i=0; i<coords.size(); i++)
+          addCoord(coords.at(i), ids.empty()?noId:ids.at(i));
 
         coords.clear();
+        ids.clear();
       }
     }
     else
-      children[findChild(coord.x, coord.y)].addCoord(coord);
+      children[findChild(coord.x, coord.y)].addCoord(coord, id);
+  }
+
+  //################################################################################################
+  //! Move each coord to its new position, coords that have left their leaf are removed into moved
+  /*!
+  The bounds are those implied by the split lines of the ancestors of this cell, they are infinite
+  at the root so that coords outside the tree are routed the same way as addCoord().
+  */
+  template<typename Position>
+  void updatePositions(const Position& position, float loX, float hiX, float loY, float hiY, std::vector<std::pair<Coord, int>>& moved)
+  {
+    if(children)
+    {
+      children[0].updatePositions(position, loX, cx, loY, cy, moved);
+      children[1].updatePositions(position, cx, hiX, loY, cy, moved);
+      children[2].updatePositions(position, loX, cx, cy, hiY, moved);
+      children[3].updatePositions(position, cx, hiX, cy, hiY, moved);
+      return;
+    }
+
+    for(size_t i=0; i<coords.size();)
+    {
+      Coord c = position(ids.at(i));
+      if(c.x>=loX && c.x<hiX && c.y>=loY && c.y<hiY)
+      {
+        coords[i] = c;
+        i++;
+        continue;
+      }
+
+      moved.emplace_back(c, ids.at(i));
+      coords[i] = coords.back();
+      ids[i] = ids.back();
+      coords.pop_back();
+      ids.pop_back();
+    }
+  }
+
+  //################################################################################################
+  //! Collapse subtrees that hold no more than half a cell of coords, returns the number of coords
+  /*!
+  Merging at half the cell size rather than the cell size stops cells that hover around the limit
+  from being split and merged on alternate frames.
+  */
+  int mergeSparse()
+  {
+    if(!children)
+      return int(coords.size());
+
+    int count=0;
+    for(int q=0; q<4; q++)
+      count += children[q].mergeSparse();
+
+    if(count<=cellSize/2)
+    {
+      //The children are all leaves, any child with children of its own would have merged.
+      for(int q=0; q<4; q++)
+      {
+        coords.insert(coords.end(), children[q].coords.begin(), children[q].coords.end());
+        ids.insert(ids.end(), children[q].ids.begin(), children[q].ids.end());
+      }
+
+      delete[] children;
+      children = nullptr;
+    }
+
+    return count;
   }
 
   //################################################################################################
@@ -220,11 +387,229 @@ struct QuadTreeFloat::Cell
       }
     }
   }
+
+  //################################################################################################
+  void kClosestPoints(float x, float y, int k, float& distSQ, std::vector<QuadTreeFloat::CoordDistance>& results)
+  {
+    if(children)
+    {
+      if(x<cx)
+      {
+        float dx = cx-x;
+        dx*=dx;
+
+        if(y<cy)
+        {
+          float dy = cy-y;
+          dy*=dy;
+
+          //0=x0 y0 <--
+          //1=x1 y0
+          //2=x0 y1
+          //3=x1 y1
+
+          children[0].kClosestPoints(x, y, k, distSQ, results);
+
+          if(dx<distSQ)
+            children[1].kClosestPoints(x, y, k, distSQ, results);
+
+          if(dy<distSQ)
+            children[2].kClosestPoints(x, y, k, distSQ, results);
+
+          if((dx+dy)<distSQ)
+            children[3].kClosestPoints(x, y, k, distSQ, results);
+        }
+        else
+        {
+          float dy = y-cy;
+          dy*=dy;
+
+          //0=x0 y0
+          //1=x1 y0
+          //2=x0 y1 <--
+          //3=x1 y1
+
+          children[2].kClosestPoints(x, y, k, distSQ, results);
+
+          if(dx<distSQ)
+            children[3].kClosestPoints(x, y, k, distSQ, results);
+
+          if(dy<distSQ)
+            children[0].kClosestPoints(x, y, k, distSQ, results);
+
+          if((dx+dy)<distSQ)
+            children[1].kClosestPoints(x, y, k, distSQ, results);
+        }
+      }
+      else
+      {
+        float dx = x-cx;
+        dx*=dx;
+
+        if(y<cy)
+        {
+          float dy = cy-y;
+          dy*=dy;
+
+          //0=x0 y0
+          //1=x1 y0 <--
+          //2=x0 y1
+          //3=x1 y1
+
+          children[1].kClosestPoints(x, y, k, distSQ, results);
+
+          if(dx<distSQ)
+            children[0].kClosestPoints(x, y, k, distSQ, results);
+
+          if(dy<distSQ)
+            children[3].kClosestPoints(x, y, k, distSQ, results);
+
+          if((dx+dy)<distSQ)
+            children[2].kClosestPoints(x, y, k, distSQ, results);
+        }
+        else
+        {
+          float dy = y-cy;
+          dy*=dy;
+
+          //0=x0 y0
+          //1=x1 y0
+          //2=x0 y1
+          //3=x1 y1 <--
+
+          children[3].kClosestPoints(x, y, k, distSQ, results);
+
+          if(dx<distSQ)
+            children[2].kClosestPoints(x, y, k, distSQ, results);
+
+          if(dy<distSQ)
+            children[1].kClosestPoints(x, y, k, distSQ, results);
+
+          if((dx+dy)<distSQ)
+            children[0].kClosestPoints(x, y, k, distSQ, results);
+        }
+      }
+    }
+    else
+    {
+      const Coord* c = coords.data();
+      const Coord* cMax = c + coords.size();
+      for(;c<cMax; c++)
+      {
+        float dx = c->x-x;
+        float dy = c->y-y;
+        float nDist = (dx*dx) + (dy*dy);
+        if(nDist<distSQ)
+          insertResult(c, nDist, k, distSQ, results);
+      }
+    }
+  }
+
+  //################################################################################################
+  //! Visit the leaves in order of great circle distance from the query, pruning by box distance
+  /*!
+  The lo/hi bounds are the longitude/latitude region that is routed to this cell.
+  */
+  template<typename Leaf>
+  void visitGreatCircle(const GreatCircleQuery& q, float loX, float hiX, float loY, float hiY, float& distSQ, const Leaf& leaf)
+  {
+    if(children)
+    {
+      float cLoX[4] = {loX, cx, loX, cx};
+      float cHiX[4] = {cx, hiX, cx, hiX};
+      float cLoY[4] = {loY, loY, cy, cy};
+      float cHiY[4] = {cy, cy, hiY, hiY};
+
+      double d[4];
+      int order[4] = {0, 1, 2, 3};
+      for(int i=0; i<4; i++)
+      {
+        d[i] = boxAngle(q, cLoX[i], cHiX[i], cLoY[i], cHiY[i]);
+        d[i]*=d[i];
+      }
+      std::sort(order, order+4, [&](int a, int b){return d[a]<d[b];});
+
+      for(int i : order)
+        if(d[i]<double(distSQ))
+          children[i].visitGreatCircle(q, cLoX[i], cHiX[i], cLoY[i], cHiY[i], distSQ, leaf);
+    }
+    else
+    {
+      const Coord* c = coords.data();
+      const Coord* cMax = c + coords.size();
+      for(;c<cMax; c++)
+      {
+        double a = centralAngle(q, double(c->x)*degToRad, double(c->y)*degToRad);
+        float nDist = float(a*a);
+        if(nDist<distSQ)
+          leaf(c, nDist);
+      }
+    }
+  }
+
+  //################################################################################################
+  //! Insert a result keeping the list sorted, if the coord is already present from another image
+  //! of the query point only the closer of the two distances is kept.
+  static void insertResult(const QuadTreeFloat::Coord* c, float nDist, int k, float& distSQ, std::vector<QuadTreeFloat::CoordDistance>& results)
+  {
+    for(size_t i=0; i<results.size(); i++)
+    {
+      if(results.at(i).coord == c)
+      {
+        if(results.at(i).distSQ<=nDist)
+          return;
+        results.erase(results.begin()+int(i));
+        break;
+      }
+    }
+
+    detail::insertClosest(QuadTreeFloat::CoordDistance(c, nDist), k, distSQ, results);
+  }
+
+  //################################################################################################
+  void coordsInRect(float minX, float maxX, float minY, float maxY, std::vector<QuadTreeFloat::Coord>& results)
+  {
+    if(children)
+    {
+      //0=x0 y0
+      //1=x1 y0
+      //2=x0 y1
+      //3=x1 y1
+      bool x0 = minX<cx;
+      bool x1 = maxX>=cx;
+      bool y0 = minY<cy;
+      bool y1 = maxY>=cy;
+
+      if(x0 && y0)
+        children[0].coordsInRect(minX, maxX, minY, maxY, results);
+
+      if(x1 && y0)
+        children[1].coordsInRect(minX, maxX, minY, maxY, results);
+
+      if(x0 && y1)
+        children[2].coordsInRect(minX, maxX, minY, maxY, results);
+
+      if(x1 && y1)
+        children[3].coordsInRect(minX, maxX, minY, maxY, results);
+    }
+    else
+    {
+      const Coord* c = coords.data();
+      const Coord* cMax = c + coords.size();
+      for(;c<cMax; c++)
+        if(c->x>=minX && c->x<=maxX && c->y>=minY && c->y<=maxY)
+          results.push_back(*c);
+    }
+  }
 };
 
 //##################################################################################################
 QuadTreeFloat::QuadTreeFloat(float minX, float maxX, float minY, float maxY, int cellSize):
-  m_root(new Cell(cellSize))
+  m_root(new Cell(cellSize)),
+  m_minX(minX),
+  m_maxX(maxX),
+  m_minY(minY),
+  m_maxY(maxY)
 {
   m_root->radX = (maxX-minX)/2;
   m_root->radY = (maxY-minY)/2;
@@ -241,15 +626,213 @@ QuadTreeFloat::~QuadTreeFloat()
 //##################################################################################################
 void QuadTreeFloat::addCoord(const QuadTreeFloat::Coord& coord)
 {
-  m_root->addCoord(coord);
+  m_root->addCoord(wrapCoord(coord), m_trackIds?m_count:noId);
+  m_count++;
+}
+
+//##################################################################################################
+void QuadTreeFloat::updateAll(const Coord* newPositions)
+{
+  //The cells do not record which coord is which until the first call, so build the tree again
+  //from the new positions with ids and update it in place from then on.
+  if(!m_trackIds)
+  {
+    Cell* root = new Cell(m_root->cellSize);
+    root->radX = m_root->radX;
+    root->radY = m_root->radY;
+    root->cx = m_root->cx;
+    root->cy = m_root->cy;
+    delete m_root;
+    m_root = root;
+
+    m_trackIds = true;
+    for(int i=0; i<m_count; i++)
+      m_root->addCoord(wrapCoord(newPositions[i]), i);
+    return;
+  }
+
+  auto position = [&](int id)
+  {
+    return wrapCoord(newPositions[id]);
+  };
+
+  const float inf = std::numeric_limits<float>::infinity();
+  m_moved.clear();
+  m_root->updatePositions(position, -inf, inf, -inf, inf, m_moved);
+
+  for(const auto& move : m_moved)
+    m_root->addCoord(move.first, move.second);
+
+  m_root->mergeSparse();
 }
 
 //##################################################################################################
 QuadTreeFloat::Coord QuadTreeFloat::closestPoint(const QuadTreeFloat::Coord& point, float& distSQ)
 {
   const Coord* closestPoint=nullptr;
-  m_root->closestPoint(point.x, point.y, distSQ, closestPoint);
+
+  if(m_geographic)
+  {
+    searchGreatCircle(point, distSQ, [&](const Coord* c, float nDist)
+    {
+      closestPoint = c;
+      distSQ = nDist;
+    });
+    return (closestPoint)?*closestPoint:Coord();
+  }
+
+  searchImages(point, distSQ, [&](float x, float y)
+  {
+    m_root->closestPoint(x, y, distSQ, closestPoint);
+  });
   return (closestPoint)?*closestPoint:Coord();
 }
 
+//##################################################################################################
+void QuadTreeFloat::kClosestPoints(const QuadTreeFloat::Coord& point, int k, float& distSQ, std::vector<CoordDistance>& results)
+{
+  if(m_geographic)
+  {
+    searchGreatCircle(point, distSQ, [&](const Coord* c, float nDist)
+    {
+      Cell::insertResult(c, nDist, k, distSQ, results);
+    });
+    return;
+  }
+
+  searchImages(point, distSQ, [&](float x, float y)
+  {
+    m_root->kClosestPoints(x, y, k, distSQ, results);
+  });
+}
+
+//##################################################################################################
+void QuadTreeFloat::coordsInRect(const Coord& min, const Coord& max, std::vector<Coord>& results)
+{
+  //Split each axis of the rectangle into at most two ranges that lie inside the bounds.
+  auto ranges = [&](bool periodic, float lo, float hi, float bMin, float bMax, float* out)
+  {
+    float period = bMax-bMin;
+    if(!periodic)
+    {
+      out[0]=lo; out[1]=hi;
+      return 1;
+    }
+
+    if((hi-lo)>=period)
+    {
+      out[0]=bMin; out[1]=bMax;
+      return 1;
+    }
+
+    float wLo = wrap(lo, bMin, bMax);
+    float wHi = wLo + (hi-lo);
+    out[0]=wLo; out[1]=std::min(wHi, bMax);
+    if(wHi<=bMax)
+      return 1;
+
+    out[2]=bMin; out[3]=wHi-period;
+    return 2;
+  };
+
+  float xr[4];
+  float yr[4];
+  int nx = ranges(m_periodicX, min.x, max.x, m_minX, m_maxX, xr);
+  int ny = ranges(m_periodicY, min.y, max.y, m_minY, m_maxY, yr);
+
+  for(int i=0; i<nx; i++)
+    for(int j=0; j<ny; j++)
+      m_root->coordsInRect(xr[i*2], xr[i*2+1], yr[j*2], yr[j*2+1], results);
+}
+
+//##################################################################################################
+void QuadTreeFloat::setPeriodic(bool periodicX, bool periodicY)
+{
+  m_periodicX = periodicX;
+  m_periodicY = periodicY;
+}
+
+//##################################################################################################
+void QuadTreeFloat::setGeographic(bool geographic)
+{
+  m_geographic = geographic;
+}
+
+//##################################################################################################
+template<typename Search>
+void QuadTreeFloat::searchImages(const Coord& point, float& distSQ, const Search& search)
+{
+  if(!m_periodicX && !m_periodicY)
+  {
+    search(point.x, point.y);
+    return;
+  }
+
+  //Search from the image of the point inside the bounds first, then from the images in the
+  //neighbouring periods, skipping any that are further from the bounds than the current best. Only
+  //the periodic axes are wrapped, coords can lie outside the bounds of the other axis so it does
+  //not contribute to the distance.
+  Coord wrapped = wrapCoord(point);
+  float x = wrapped.x;
+  float y = wrapped.y;
+  float periodX = m_maxX-m_minX;
+  float periodY = m_maxY-m_minY;
+
+  float xs[3] = {x, x-periodX, x+periodX};
+  float ys[3] = {y, y-periodY, y+periodY};
+  int nx = m_periodicX?3:1;
+  int ny = m_periodicY?3:1;
+
+  for(int i=0; i<nx; i++)
+  {
+    float bx = (!m_periodicX)?0.0f:(xs[i]<m_minX)?(m_minX-xs[i]):((xs[i]>m_maxX)?(xs[i]-m_maxX):0.0f);
+    bx*=bx;
+
+    for(int j=0; j<ny; j++)
+    {
+      float by = (!m_periodicY)?0.0f:(ys[j]<m_minY)?(m_minY-ys[j]):((ys[j]>m_maxY)?(ys[j]-m_maxY):0.0f);
+      by*=by;
+
+      if((i==0 && j==0) || (bx+by)<distSQ)
+        search(xs[i], ys[j]);
+    }
+  }
+}
+
+//##################################################################################################
+template<typename Leaf>
+void QuadTreeFloat::searchGreatCircle(const Coord& point, float& distSQ, const Leaf& leaf)
+{
+  //The root box is the bounds of the tree, except that coords can lie outside the bounds of a
+  //non-periodic axis in the edge cells, so on those axes it reaches out to cover every longitude or
+  //latitude as well.
+  float loX = m_periodicX?m_minX:std::min(m_minX, -180.0f);
+  float hiX = m_periodicX?m_maxX:std::max(m_maxX,  180.0f);
+  float loY = m_periodicY?m_minY:std::min(m_minY,  -90.0f);
+  float hiY = m_periodicY?m_maxY:std::max(m_maxY,   90.0f);
+  m_root->visitGreatCircle(GreatCircleQuery(point.x, point.y), loX, hiX, loY, hiY, distSQ, leaf);
+}
+
+//##################################################################################################
+float QuadTreeFloat::wrap(float v, float min, float max) const
+{
+  float period = max-min;
+  if(period<=0.0f)
+    return v;
+
+  v = min + std::fmod(v-min, period);
+  if(v<min)
+    v+=period;
+  if(v>=max)
+    v-=period;
+  return v;
+}
+
+//##################################################################################################
+QuadTreeFloat::Coord QuadTreeFloat::wrapCoord(const Coord& coord) const
+{
+  return Coord(m_periodicX?wrap(coord.x, m_minX, m_maxX):coord.x,
+               m_periodicY?wrap(coord.y, m_minY, m_maxY):coord.y);
+}
+
 }
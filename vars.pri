@@ -12,3 +12,14 @@ SOURCES += src/QuadTreeFloat.cpp
 HEADERS += inc/tp_quad_tree/QuadTreeFloat.h
 
 HEADERS += inc/tp_quad_tree/QuadTreeIntTemplate.h
+HEADERS += inc/tp_quad_tree/QuadTreeIntInlineTemplate.h
+HEADERS += inc/tp_quad_tree/QuadTreePolicies.h
+HEADERS += inc/tp_quad_tree/FrozenQuadTreeIntTemplate.h
+HEADERS += inc/tp_quad_tree/FrozenQuadTreeIntBuilder.h
+HEADERS += inc/tp_quad_tree/QueryCache.h
+HEADERS += inc/tp_quad_tree/QuadTreeExactTemplate.h
+HEADERS += inc/tp_quad_tree/Trace.h
+HEADERS += inc/tp_quad_tree/QueryProfiler.h
+HEADERS += inc/tp_quad_tree/SpatialTreeTemplate.h
+HEADERS += inc/tp_quad_tree/SegmentDistance.h
+HEADERS += inc/tp_quad_tree/AsyncQueryService.h